@@ -0,0 +1,65 @@
+#ifndef BARRIER_H
+#define BARRIER_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+
+/* Barriers and latches that spin for a while before sleeping in the kernel,
+ * unlike pthread_barrier_t, which always sleeps.  When the threads arrive
+ * close together, as in phase-based parallel code, nobody has to sleep or be
+ * woken up.
+ */
+
+/* The value barrier_wait and tree_barrier_wait return in exactly one of the
+ * threads, like PTHREAD_BARRIER_SERIAL_THREAD.
+ */
+#define BARRIER_SERIAL_THREAD 1
+
+/* A sense-reversing barrier for 'count' threads, which can be reused as soon
+ * as it returns.  The threads arriving at it all update one counter, so for
+ * many threads a tree_barrier_t scales better.
+ */
+typedef struct {
+    _Atomic unsigned int count;  /* threads yet to arrive */
+    _Atomic unsigned int phase;  /* bumped when all have arrived */
+    unsigned int total;
+} barrier_t;
+
+int barrier_init(barrier_t *b, unsigned int count);
+int barrier_destroy(barrier_t *b);
+int barrier_wait(barrier_t *b);
+
+/* A one-shot latch, which opens when it has been counted down to zero, like
+ * C++'s std::latch.
+ */
+typedef struct {
+    _Atomic unsigned int count;  /* count downs to go, and a waiters flag */
+} latch_t;
+
+int latch_init(latch_t *l, unsigned int count);
+int latch_destroy(latch_t *l);
+void latch_count_down(latch_t *l, unsigned int n);
+bool latch_try_wait(latch_t *l);
+void latch_wait(latch_t *l);
+void latch_arrive_and_wait(latch_t *l, unsigned int n);
+
+/* A combining-tree barrier for 'count' threads, for many threads.  Threads
+ * pass their index, from 0 to count - 1, and arrive at a leaf shared with a
+ * few others; the last one to arrive at a node carries on to its parent, so
+ * each counter only sees a few threads.  The last thread at the root releases
+ * them all.
+ */
+struct tree_barrier_node;
+
+typedef struct {
+    struct tree_barrier_node *nodes;
+    unsigned int numnodes;
+    unsigned int total;
+    _Atomic unsigned int phase;
+} tree_barrier_t;
+
+int tree_barrier_init(tree_barrier_t *b, unsigned int count);
+int tree_barrier_destroy(tree_barrier_t *b);
+int tree_barrier_wait(tree_barrier_t *b, unsigned int index);
+
+#endif /* BARRIER_H */
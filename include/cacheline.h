@@ -0,0 +1,12 @@
+#ifndef CACHELINE_H
+#define CACHELINE_H
+
+/* The size of a cache line.  Data that different threads write is aligned to
+ * it, so that they do not share a line and bounce it between their CPUs.
+ * Define CACHELINE to a power of 2 to build for other line sizes.
+ */
+#ifndef CACHELINE
+#define CACHELINE 64
+#endif
+
+#endif
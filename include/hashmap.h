@@ -0,0 +1,64 @@
+#ifndef HASHMAP_H
+#define HASHMAP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "percpu.h"
+#include "skinny_mutex.h"
+
+/* A concurrent hash map, with a lock per bucket.
+ *
+ * Each bucket takes one cache line, holding its skinny_mutex, a few entries,
+ * and a pointer to a chain of more entries for when it overflows.  A thread
+ * only locks the bucket of the key it works on, so threads working on
+ * different keys rarely contend, or even share a cache line.
+ *
+ * When the buckets fill up, the map starts moving its entries into a table
+ * twice the size, a bucket at a time: each thread that updates the map moves
+ * the bucket of its key and a few more, until they have all moved.  Threads
+ * carry on meanwhile, looking in the old bucket of a key until it has moved,
+ * and in the new one after.  The old table is freed with hazard_retire, once
+ * nobody is looking at it.
+ *
+ * The map holds pointers to keys and values, without copying them.  Keys
+ * cannot be NULL.  A value returned by hashmap_get may be removed and freed
+ * by another thread as soon as it is returned, so if values are freed while
+ * the map is in use they need their own reference counting.
+ */
+
+struct hashmap_table;
+
+typedef struct {
+    struct hashmap_table *current;
+    uint64_t (*hash)(const void *key);
+    bool (*equal)(const void *a, const void *b);
+    skinny_mutex_t resize_lock;
+    percpu_counter_t count;
+} hashmap_t;
+
+/* hash and equal may be NULL, to compare keys as pointers. */
+int hashmap_init(hashmap_t *map,
+                 uint64_t (*hash)(const void *key),
+                 bool (*equal)(const void *a, const void *b));
+
+/* Frees the map, which must no longer be in use.  The keys and values are
+ * left alone.
+ */
+void hashmap_destroy(hashmap_t *map);
+
+/* The value for key, or NULL if it is not in the map. */
+void *hashmap_get(hashmap_t *map, const void *key);
+
+/* Add key to the map, or replace its value.  Returns 0 or ENOMEM. */
+int hashmap_put(hashmap_t *map, const void *key, void *value);
+
+/* Remove key from the map, returning its value, or NULL if it was not there.
+ */
+void *hashmap_remove(hashmap_t *map, const void *key);
+
+/* How many keys the map holds. */
+size_t hashmap_count(hashmap_t *map);
+
+#endif /* HASHMAP_H */
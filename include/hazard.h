@@ -0,0 +1,44 @@
+#ifndef HAZARD_H
+#define HAZARD_H
+
+/* Hazard pointers, for freeing memory that other threads might be about to
+ * access without a lock.
+ *
+ * A thread that has loaded a pointer from a shared location publishes it in
+ * one of its hazard slots, and then checks that the location still holds it.
+ * If so, whoever removes the object from the location afterwards will see the
+ * hazard, so the object stays valid until the slot is cleared.  The remover
+ * passes the object to hazard_retire instead of freeing it; retired objects
+ * are freed in batches, once no hazard slot points to them.
+ *
+ * Each thread gets its slots on first use, and gives them back when it exits,
+ * for another thread to take over along with any objects that it left
+ * retired.
+ */
+
+/* The number of hazard slots per thread.  Slot 0 is used by skinny_mutex
+ * while it reaches a fat_mutex, which can happen inside any critical section,
+ * and slots 1 and 2 by hashmap_t.
+ */
+#define HAZARD_SLOTS 3
+
+/* Publish p in this thread's hazard slot 'slot', with a full fence, so that a
+ * load following it happens after the hazard is visible to hazard_retire.
+ */
+void hazard_set(unsigned int slot, void *p);
+
+/* Load the pointer in *src, and protect it with hazard slot 'slot'. */
+void *hazard_protect(unsigned int slot, void **src);
+
+/* Clear hazard slot 'slot', once done with the object it protects. */
+void hazard_clear(unsigned int slot);
+
+/* Call free_fn(p) once no hazard slot points to p.  p must no longer be
+ * reachable from shared locations, so that no new hazards to it can appear.
+ */
+void hazard_retire(void *p, void (*free_fn)(void *p));
+
+/* Free whatever this thread has retired and is no longer protected. */
+void hazard_scan(void);
+
+#endif /* HAZARD_H */
@@ -0,0 +1,114 @@
+#ifndef PERCPU_H
+#define PERCPU_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "cacheline.h"
+
+/* Per-CPU counters, for statistics that many threads update.
+ *
+ * A counter has a slot of its own cache line for each CPU.  On x86-64 Linux,
+ * percpu_counter_add adds to the slot of the CPU it runs on in a restartable
+ * sequence (rseq), which the kernel restarts if the thread is preempted or
+ * migrated in the middle, so that a plain add instruction is enough.
+ * Elsewhere, or when the thread has no rseq area registered, it does an
+ * atomic add to one of a few more slots, picked per thread.  Either way,
+ * threads updating a counter rarely share a cache line, and
+ * percpu_counter_read sums the slots.
+ */
+
+#if defined(__x86_64__) && defined(__linux__) && defined(__has_include)
+#if __has_include(<sys/rseq.h>)
+#include <sys/rseq.h>
+#define PERCPU_RSEQ 1
+#endif
+#endif
+
+struct percpu_slot {
+    _Atomic int64_t value;
+} __attribute__((aligned(CACHELINE)));
+
+typedef struct {
+    /* percpu_slots per-CPU slots, then PERCPU_THREAD_SLOTS for the rest. */
+    struct percpu_slot *slots;
+} percpu_counter_t;
+
+#define PERCPU_THREAD_SLOTS 16
+
+/* The number of per-CPU slots in each counter. */
+extern unsigned int percpu_slots;
+
+/* The number of slots that rseq may add to: percpu_slots, or 0 if rseq is not
+ * available.
+ */
+extern unsigned int percpu_rseq_slots;
+
+int percpu_counter_init(percpu_counter_t *c);
+void percpu_counter_destroy(percpu_counter_t *c);
+void percpu_counter_add_slow(percpu_counter_t *c, int64_t v);
+int64_t percpu_counter_read(percpu_counter_t *c);
+
+#ifdef PERCPU_RSEQ
+/* The asm below finds a CPU's slot by shifting its number by this much. */
+#define PERCPU_SLOT_SIZE sizeof(struct percpu_slot)
+_Static_assert((PERCPU_SLOT_SIZE & (PERCPU_SLOT_SIZE - 1)) == 0,
+               "percpu slots are a power of 2 bytes");
+
+/* Add v to the slot of the current CPU in a restartable sequence.  Returns
+ * false if it was aborted, or there is no slot for this CPU.
+ */
+static inline bool percpu_rseq_add(struct percpu_slot *slots, int64_t v)
+{
+    struct rseq *rs =
+        (struct rseq *) ((char *) __builtin_thread_pointer() + __rseq_offset);
+
+    /* The critical section runs from 1 to 2, and the add is its commit.  The
+     * abort handler at 4 must follow the signature the area was registered
+     * with.
+     */
+    __asm__ goto(
+        ".pushsection __rseq_cs, \"aw\"\n\t"
+        ".balign 32\n\t"
+        "3:\n\t"
+        ".long 0, 0\n\t"
+        ".quad 1f, 2f - 1f, 4f\n\t"
+        ".popsection\n\t"
+        "leaq 3b(%%rip), %%rax\n\t"
+        "movq %%rax, %[rseq_cs]\n\t"
+        "1:\n\t"
+        "movl %[cpu_id], %%eax\n\t"
+        "cmpl %[nslots], %%eax\n\t"
+        "jae 4f\n\t"
+        "shlq %[shift], %%rax\n\t"
+        "addq %[v], (%[slots], %%rax)\n\t"
+        "2:\n\t"
+        ".pushsection __rseq_failure, \"ax\"\n\t"
+        ".long %c[sig]\n\t"
+        "4:\n\t"
+        "jmp %l[abort]\n\t"
+        ".popsection\n\t"
+        :
+        : [rseq_cs] "m"(rs->rseq_cs), [cpu_id] "m"(rs->cpu_id),
+          [nslots] "r"(percpu_rseq_slots), [slots] "r"(slots), [v] "r"(v),
+          [shift] "i"(__builtin_ctz(PERCPU_SLOT_SIZE)),
+          [sig] "i"(RSEQ_SIG)
+        : "rax", "memory", "cc"
+        : abort);
+    return true;
+abort:
+    return false;
+}
+#endif
+
+static inline void percpu_counter_add(percpu_counter_t *c, int64_t v)
+{
+#ifdef PERCPU_RSEQ
+    if (__builtin_expect(percpu_rseq_add(c->slots, v), 1))
+        return;
+#endif
+    percpu_counter_add_slow(c, v);
+}
+
+#endif /* PERCPU_H */
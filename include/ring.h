@@ -0,0 +1,116 @@
+#ifndef RING_H
+#define RING_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "cacheline.h"
+#include "thread.h"
+
+/* Bounded lock-free rings of fixed-size elements, for passing data between
+ * threads, e.g. between the stages of a pipeline.
+ *
+ * spsc_ring_t has one producer and one consumer, and both sides are
+ * wait-free.  The producer's and consumer's positions are on cache lines of
+ * their own, and each side keeps a copy of the other's, so that it only reads
+ * the other's line when the ring looks full or empty.  Pushing or popping a
+ * batch of elements publishes the new position once, for the whole batch.
+ *
+ * mpsc_ring_t has any number of producers and one consumer, to fan in.
+ * Producers claim slots with a compare-and-swap, which makes them lock-free
+ * rather than wait-free, and each slot carries a sequence number saying
+ * whether it is full.
+ *
+ * Elements are copied in and out.  The ring functions never block unless the
+ * ring was created with RING_BLOCKING, which lets the _wait functions sleep on
+ * an eventcount until there is room or data.  That costs a fence on each push
+ * and pop, so rings whose users only poll, like tasklets, which must not
+ * block the thread that runs them, are better off without it.
+ */
+
+/* A flag for spsc_ring_init and mpsc_ring_init, to allow the _wait functions.
+ */
+#define RING_BLOCKING 1
+
+typedef struct {
+    struct {
+        _Atomic size_t tail;  /* published to the consumer */
+        size_t head_cache;    /* the consumer's head, as last read */
+    } prod __attribute__((aligned(CACHELINE)));
+
+    struct {
+        _Atomic size_t head;  /* published to the producer */
+        size_t tail_cache;    /* the producer's tail, as last read */
+    } cons __attribute__((aligned(CACHELINE)));
+
+    char *buf __attribute__((aligned(CACHELINE)));
+    size_t mask;
+    size_t elem_size;
+    bool blocking;
+    struct eventcount not_empty;
+    struct eventcount not_full;
+} spsc_ring_t;
+
+/* The capacity is rounded up to a power of 2.  Returns 0, EINVAL or ENOMEM.
+ */
+int spsc_ring_init(spsc_ring_t *r,
+                   size_t capacity,
+                   size_t elem_size,
+                   int flags);
+void spsc_ring_destroy(spsc_ring_t *r);
+
+/* Push up to n elements, returning how many fit. */
+size_t spsc_ring_push(spsc_ring_t *r, const void *elems, size_t n);
+
+/* Pop up to n elements into elems, returning how many there were. */
+size_t spsc_ring_pop(spsc_ring_t *r, void *elems, size_t n);
+
+/* Push all n elements, waiting for room as needed. */
+void spsc_ring_push_wait(spsc_ring_t *r, const void *elems, size_t n);
+
+/* Pop between 1 and n elements, waiting until there are some. */
+size_t spsc_ring_pop_wait(spsc_ring_t *r, void *elems, size_t n);
+
+typedef struct {
+    struct {
+        _Atomic size_t tail;  /* the next position for a producer */
+    } prod __attribute__((aligned(CACHELINE)));
+
+    struct {
+        size_t head;  /* the next position to pop */
+    } cons __attribute__((aligned(CACHELINE)));
+
+    char *slots __attribute__((aligned(CACHELINE)));
+    size_t mask;
+    size_t elem_size;
+    size_t slot_size;
+    bool blocking;
+    struct eventcount not_empty;
+    struct eventcount not_full;
+} mpsc_ring_t;
+
+int mpsc_ring_init(mpsc_ring_t *r,
+                   size_t capacity,
+                   size_t elem_size,
+                   int flags);
+void mpsc_ring_destroy(mpsc_ring_t *r);
+
+/* Push all n elements, in order and contiguous with respect to other
+ * producers, or none if there is not room for them all.  Returns whether it
+ * pushed them.
+ */
+bool mpsc_ring_push(mpsc_ring_t *r, const void *elems, size_t n);
+
+/* Pop up to n elements into elems, returning how many there were.  Only one
+ * thread may pop at a time.
+ */
+size_t mpsc_ring_pop(mpsc_ring_t *r, void *elems, size_t n);
+
+/* Push all n elements, which must fit in the ring, waiting for room. */
+void mpsc_ring_push_wait(mpsc_ring_t *r, const void *elems, size_t n);
+
+/* Pop between 1 and n elements, waiting until there are some. */
+size_t mpsc_ring_pop_wait(mpsc_ring_t *r, void *elems, size_t n);
+
+#endif /* RING_H */
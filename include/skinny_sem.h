@@ -0,0 +1,149 @@
+#ifndef SKINNY_SEM_H
+#define SKINNY_SEM_H
+
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+/* A counting semaphore in one 64-bit word, where sem_t takes 32 bytes.  The
+ * low half holds the count, and the high half the number of threads waiting
+ * for it, so that posting and taking are a compare-and-swap, and
+ * skinny_sem_post only makes a system call when somebody is asleep.
+ */
+typedef struct {
+    _Atomic uint64_t val;
+} skinny_sem_t;
+
+#define SKINNY_SEM_INITIALIZER(value) \
+    {                                 \
+        (uint64_t) (value)            \
+    }
+
+#define SKINNY_SEM_WAITER ((uint64_t) 1 << 32)
+
+static inline int skinny_sem_init(skinny_sem_t *s, unsigned int value)
+{
+    atomic_init(&s->val, value);
+    return 0;
+}
+
+static inline int skinny_sem_destroy(skinny_sem_t *s)
+{
+    return atomic_load(&s->val) < SKINNY_SEM_WAITER ? 0 : EBUSY;
+}
+
+static inline int skinny_sem_trywait(skinny_sem_t *s)
+{
+    uint64_t v = atomic_load_explicit(&s->val, memory_order_relaxed);
+    while ((uint32_t) v)
+        if (__builtin_expect(atomic_compare_exchange_weak_explicit(
+                                 &s->val, &v, v - 1, memory_order_acquire,
+                                 memory_order_relaxed),
+                             1))
+            return 0;
+    return EAGAIN;
+}
+
+int skinny_sem_wait_slow(skinny_sem_t *s, const struct timespec *abstime);
+
+static inline int skinny_sem_wait(skinny_sem_t *s)
+{
+    if (!skinny_sem_trywait(s))
+        return 0;
+    return skinny_sem_wait_slow(s, NULL);
+}
+
+/* abstime is measured against CLOCK_REALTIME, as for sem_timedwait. */
+static inline int skinny_sem_timedwait(skinny_sem_t *s,
+                                       const struct timespec *abstime)
+{
+    if (!skinny_sem_trywait(s))
+        return 0;
+    return skinny_sem_wait_slow(s, abstime);
+}
+
+void skinny_sem_wake(skinny_sem_t *s);
+
+static inline int skinny_sem_post(skinny_sem_t *s)
+{
+    uint64_t v = atomic_load_explicit(&s->val, memory_order_relaxed);
+    do {
+        if ((uint32_t) v == UINT32_MAX)
+            return EOVERFLOW;
+    } while (!atomic_compare_exchange_weak_explicit(
+        &s->val, &v, v + 1, memory_order_release, memory_order_relaxed));
+    if (__builtin_expect(v >= SKINNY_SEM_WAITER, 0))
+        skinny_sem_wake(s);
+    return 0;
+}
+
+static inline int skinny_sem_getvalue(skinny_sem_t *s, unsigned int *value)
+{
+    *value = (uint32_t) atomic_load_explicit(&s->val, memory_order_relaxed);
+    return 0;
+}
+
+/* A one-shot event: once set, waiting for it returns at once.  The word is 0
+ * while unset, 1 while unset with threads asleep waiting for it, and 2 once
+ * set.
+ */
+typedef struct {
+    _Atomic unsigned int val;
+} skinny_event_t;
+
+#define SKINNY_EVENT_INITIALIZER \
+    {                            \
+        0                        \
+    }
+
+#define SKINNY_EVENT_SET 2
+
+static inline int skinny_event_init(skinny_event_t *e)
+{
+    atomic_init(&e->val, 0);
+    return 0;
+}
+
+static inline int skinny_event_destroy(skinny_event_t *e)
+{
+    (void) e;
+    return 0;
+}
+
+static inline bool skinny_event_is_set(skinny_event_t *e)
+{
+    return atomic_load_explicit(&e->val, memory_order_acquire) ==
+           SKINNY_EVENT_SET;
+}
+
+void skinny_event_wake(skinny_event_t *e);
+
+static inline int skinny_event_set(skinny_event_t *e)
+{
+    if (__builtin_expect(atomic_exchange_explicit(&e->val, SKINNY_EVENT_SET,
+                                                  memory_order_release) == 1,
+                         0))
+        skinny_event_wake(e);
+    return 0;
+}
+
+int skinny_event_wait_slow(skinny_event_t *e, const struct timespec *abstime);
+
+static inline int skinny_event_wait(skinny_event_t *e)
+{
+    if (skinny_event_is_set(e))
+        return 0;
+    return skinny_event_wait_slow(e, NULL);
+}
+
+static inline int skinny_event_timedwait(skinny_event_t *e,
+                                         const struct timespec *abstime)
+{
+    if (skinny_event_is_set(e))
+        return 0;
+    return skinny_event_wait_slow(e, abstime);
+}
+
+#endif /* SKINNY_SEM_H */
@@ -3,7 +3,9 @@
 
 #include <assert.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 #include "skinny_mutex.h"
 
@@ -13,13 +15,32 @@ static inline thread_handle_t thread_handle_current(void)
     return pthread_self();
 }
 
+struct thread_slot;
+
 struct thread {
     thread_handle_t handle;
+    struct thread_slot *slot;
     void *init;
 };
 
+/* thread_init runs func(data) in a thread, and thread_fini waits for it to
+ * return.  Threads are cached: rather than exiting, a thread parks in
+ * thread_fini for the next thread_init to reuse, up to THREAD_CACHE_SIZE of
+ * them.  A function that calls pthread_exit ends its thread, which is then
+ * not reused.
+ *
+ * Between functions, a thread gets back the signal mask, CPU affinity and
+ * name it was created with, and cancellation is enabled and deferred again.
+ * But thread-local variables outlive the function, and the destructors of
+ * pthread keys only run when the thread exits; a library whose thread-local
+ * state must not leak into the next function registers a function to reset
+ * it with thread_on_reuse, which runs on the thread after each function that
+ * returns.  A thread also stays signed in to ThreadTracer under the name it
+ * first signed in with, and later functions are traced under that name.
+ */
 void thread_init(struct thread *thr, void (*func)(void *data), void *data);
 void thread_fini(struct thread *thr);
+void thread_on_reuse(void (*reset)(void));
 
 static inline thread_handle_t thread_get_handle(struct thread *thr)
 {
@@ -28,10 +49,16 @@ static inline thread_handle_t thread_get_handle(struct thread *thr)
 
 void thread_signal(thread_handle_t thr, int sig);
 
+struct mutex_stats;
+
 struct mutex {
     skinny_mutex_t mutex;
     bool held;
     void *init;
+#ifdef MUTEX_STATS
+    struct mutex_stats *stats;
+    uint64_t locked_at;
+#endif
 };
 
 struct cond {
@@ -39,9 +66,9 @@ struct cond {
     void *init;
 };
 
-#define MUTEX_INITIALIZER                     \
-    {                                         \
-        SKINNY_MUTEX_INITIALIZER, FALSE, NULL \
+#define MUTEX_INITIALIZER                                               \
+    {                                                                   \
+        .mutex = SKINNY_MUTEX_INITIALIZER, .held = false, .init = NULL \
     }
 
 void mutex_init(struct mutex *m);
@@ -62,32 +89,132 @@ static inline void mutex_assert_held(struct mutex *m)
     assert(m->held);
 }
 
+/* Lock statistics, for finding the locks that threads queue up on.
+ *
+ * When built with -DMUTEX_STATS (all of the code using struct mutex, as it
+ * changes its size), each lock records how long it waited to acquire the
+ * mutex and how long it held it, in histograms of timestamp counter ticks
+ * with power-of-two buckets.  The histograms are per mutex_init call site, so
+ * e.g. all the run queue mutexes add up to one line.  Mutexes initialized
+ * with MUTEX_INITIALIZER are not counted.  mutex_stats_dump writes them.
+ */
+#ifdef MUTEX_STATS
+#include <stdio.h>
+
+void mutex_init_at(struct mutex *m, const char *file, int line);
+#define mutex_init(m) mutex_init_at(m, __FILE__, __LINE__)
+void mutex_stats_dump(FILE *out);
+void mutex_stats_reset(void);
+#endif
+
 void cond_init(struct cond *c);
 void cond_fini(struct cond *c);
 void cond_wait(struct cond *c, struct mutex *m);
 void cond_signal(struct cond *c);
 void cond_broadcast(struct cond *c);
 
-struct tls_var {
-    pthread_once_t once;
-    pthread_key_t key;
+/* An eventcount lets a thread wait for a condition that other threads make
+ * true without holding a lock, e.g. for a lock-free queue to become
+ * non-empty.  The waiter does:
+ *
+ *     for (;;) {
+ *         if (try_pop(q, &item))
+ *             break;
+ *         unsigned int key = eventcount_prepare_wait(&ec);
+ *         if (try_pop(q, &item)) {
+ *             eventcount_cancel_wait(&ec);
+ *             break;
+ *         }
+ *         eventcount_commit_wait(&ec, key);
+ *     }
+ *
+ * and the thread making the condition true calls eventcount_notify after it,
+ * which cannot be missed by a waiter between prepare and commit.  When nobody
+ * is waiting, eventcount_notify is a fence and a load.
+ */
+struct eventcount {
+    _Atomic unsigned int epoch;    /* bumped by notifies, the futex word */
+    _Atomic unsigned int waiters;  /* threads between prepare and commit */
+    void *init;
 };
 
-#define TLS_VAR_DECLARE_STATIC(name)                       \
-    static pthread_once_t name##_once = PTHREAD_ONCE_INIT; \
-    static pthread_key_t name##_key;                       \
-                                                           \
-    static void name##_once_func(void)                     \
-    {                                                      \
-        pthread_key_create(&name##_key, NULL);             \
+void eventcount_init(struct eventcount *ec);
+void eventcount_fini(struct eventcount *ec);
+unsigned int eventcount_prepare_wait(struct eventcount *ec);
+void eventcount_commit_wait(struct eventcount *ec, unsigned int key);
+void eventcount_cancel_wait(struct eventcount *ec);
+void eventcount_wake(struct eventcount *ec, bool all);
+
+static inline void eventcount_notify(struct eventcount *ec)
+{
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&ec->waiters, memory_order_relaxed))
+        eventcount_wake(ec, false);
+}
+
+static inline void eventcount_notify_all(struct eventcount *ec)
+{
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&ec->waiters, memory_order_relaxed))
+        eventcount_wake(ec, true);
+}
+
+/* Thread-local pointer variables.
+ *
+ * TLS_VAR_DECLARE_STATIC declares one in native thread-local storage, so that
+ * TLS_VAR_GET and TLS_VAR_SET are a plain load and store relative to the
+ * thread pointer.  TLS_VAR_DECLARE_STATIC_DTOR declares one whose destructor
+ * is called with its value when a thread that set it to non-NULL exits, which
+ * needs a pthread key: TLS_VAR_SET also stores it there, but TLS_VAR_GET is as
+ * cheap as for the other kind.
+ *
+ * The initial-exec TLS model avoids a call to __tls_get_addr in shared
+ * libraries.  Define THREAD_TLS_DYNAMIC when building code that will be loaded
+ * with dlopen(), which might not find room for it in the static TLS block.
+ */
+#ifndef THREAD_TLS_DYNAMIC
+#define TLS_MODEL __attribute__((tls_model("initial-exec")))
+#else
+#define TLS_MODEL
+#endif
+
+#define TLS_VAR_DECLARE_STATIC(name)                      \
+    static __thread void *name##_value TLS_MODEL;         \
+                                                          \
+    static inline void *name##_get(void)                  \
+    {                                                     \
+        return name##_value;                              \
+    }                                                     \
+                                                          \
+    static inline int name##_set(void *val)               \
+    {                                                     \
+        name##_value = val;                               \
+        return 0;                                         \
     }
 
-#define TLS_VAR_GET(name)                          \
-    (pthread_once(&name##_once, name##_once_func), \
-     pthread_getspecific(name##_key))
+#define TLS_VAR_DECLARE_STATIC_DTOR(name, dtor)                       \
+    static pthread_once_t name##_once = PTHREAD_ONCE_INIT;            \
+    static pthread_key_t name##_key;                                  \
+    static __thread void *name##_value TLS_MODEL;                     \
+                                                                      \
+    static void name##_once_func(void)                                \
+    {                                                                 \
+        pthread_key_create(&name##_key, dtor);                        \
+    }                                                                 \
+                                                                      \
+    static inline void *name##_get(void)                              \
+    {                                                                 \
+        return name##_value;                                          \
+    }                                                                 \
+                                                                      \
+    static inline int name##_set(void *val)                           \
+    {                                                                 \
+        name##_value = val;                                           \
+        pthread_once(&name##_once, name##_once_func);                 \
+        return pthread_setspecific(name##_key, val);                  \
+    }
 
-#define TLS_VAR_SET(name, val)                     \
-    (pthread_once(&name##_once, name##_once_func), \
-     pthread_setspecific(name##_key, val))
+#define TLS_VAR_GET(name) name##_get()
+#define TLS_VAR_SET(name, val) name##_set(val)
 
 #endif
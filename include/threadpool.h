@@ -37,4 +37,17 @@ int threadpool_add(threadpool_t *pool, void (*func)(void *), void *arg);
  */
 int threadpool_destroy(threadpool_t *pool, bool gracegul);
 
+typedef struct {
+    long long added;     /* tasks added to the queue */
+    long long completed; /* tasks that have run */
+} threadpool_stats_t;
+
+/**
+ * @brief Reads the task counts of a thread pool so far.
+ * @param pool Thread pool to read.
+ * @param stats Where to store the counts.
+ * @return 0 if all goes well, tp_invalid otherwise.
+ */
+int threadpool_stats(threadpool_t *pool, threadpool_stats_t *stats);
+
 #endif
@@ -2,15 +2,147 @@
 #define THREAD_TRACER_H
 
 #include <stddef.h>
+#include <stdint.h>
+
+/* Why a thread is waiting, for the off-CPU breakdown of scopes (see
+ * THREADTRACEROFFCPU in the README).  ThreadKit marks its own waits on
+ * skinny mutexes and condition variables; applications can mark I/O.
+ * TT_WAIT_CONDVAR covers every wait for another thread to signal something:
+ * besides condition variables, ThreadKit's barriers, latches, skinny
+ * semaphores and skinny events.
+ */
+enum tt_wait_reason {
+    TT_WAIT_MUTEX,
+    TT_WAIT_CONDVAR,
+    TT_WAIT_IO,
+    TT_WAIT_REASONS
+};
+
+/* Define THREADTRACER_DISABLE to compile all the TT_ macros below out of a
+ * translation unit.  Instrumentation can then stay in hot paths of release
+ * builds at no cost.
+ *
+ * Every event has a category, which can be used to filter events at runtime
+ * (see THREADTRACERCATEGORIES in the README).  The macros without a _CAT
+ * suffix use the "generic" category.
+ */
+#ifndef THREADTRACER_DISABLE
 
 #define TT_ENTRY(S) tt_signin(S)
-int tt_signin(const char *threadname);
 
-#define TT_BEGIN(S) tt_stamp("generic", S, "B")
-#define TT_END(S) tt_stamp("generic", S, "E")
-int tt_stamp(const char *cat, const char *tag, const char *phase);
+#define TT_BEGIN(S) TT_BEGIN_CAT("generic", S)
+#define TT_END(S) TT_END_CAT("generic", S)
+#define TT_BEGIN_CAT(C, S) tt_stamp(C, S, "B")
+#define TT_END_CAT(C, S) tt_stamp(C, S, "E")
+
+/* TT_SCOPE records a "B" event, and the matching "E" event when the enclosing
+ * block is left, however that happens.
+ */
+#define TT_SCOPE(S) TT_SCOPE_CAT("generic", S)
+#define TT_SCOPE_CAT(C, S)                                     \
+    struct tt_scope TT_SCOPE_VAR(__COUNTER__)                  \
+        __attribute__((cleanup(tt_scope_end), unused)) =       \
+            (tt_stamp(C, S, "B"), (struct tt_scope){(C), (S)})
+#define TT_SCOPE_VAR(N) TT_SCOPE_VAR_(N)
+#define TT_SCOPE_VAR_(N) tt_scope_##N
+
+/* Asynchronous spans may begin on one thread and end on another.  Spans with
+ * the same id and tag are matched, so the id must be unique among the spans
+ * that are in flight at the same time; a pointer to the traced object is a
+ * good choice.
+ */
+#define TT_ASYNC_BEGIN(ID, S) TT_ASYNC_BEGIN_CAT("generic", ID, S)
+#define TT_ASYNC_END(ID, S) TT_ASYNC_END_CAT("generic", ID, S)
+#define TT_ASYNC_BEGIN_CAT(C, ID, S) \
+    tt_stamp_id(C, S, "b", (uint64_t)(uintptr_t)(ID))
+#define TT_ASYNC_END_CAT(C, ID, S) \
+    tt_stamp_id(C, S, "e", (uint64_t)(uintptr_t)(ID))
+
+/* Flow events draw an arrow from the scope enclosing TT_FLOW_BEGIN to the
+ * scope enclosing the TT_FLOW_END with the same id, e.g. from the submission
+ * of a task to its execution on another thread.
+ */
+#define TT_FLOW_BEGIN(ID, S) TT_FLOW_BEGIN_CAT("generic", ID, S)
+#define TT_FLOW_END(ID, S) TT_FLOW_END_CAT("generic", ID, S)
+#define TT_FLOW_BEGIN_CAT(C, ID, S) \
+    tt_stamp_id(C, S, "s", (uint64_t)(uintptr_t)(ID))
+#define TT_FLOW_END_CAT(C, ID, S) \
+    tt_stamp_id(C, S, "f", (uint64_t)(uintptr_t)(ID))
+
+/* Counters are plotted over time, e.g. the depth of a queue. */
+#define TT_COUNTER(S, V) TT_COUNTER_CAT("generic", S, V)
+#define TT_COUNTER_CAT(C, S, V) tt_counter(C, S, V)
+
+/* Instant events mark a single point in time on the calling thread. */
+#define TT_INSTANT(S) TT_INSTANT_CAT("generic", S)
+#define TT_INSTANT_CAT(C, S) tt_stamp(C, S, "i")
+
+/* Waits can nest, e.g. a condition variable wait reacquires a mutex, and are
+ * attributed to the outermost reason.
+ */
+#define TT_WAIT_BEGIN(R) tt_wait_begin(R)
+#define TT_WAIT_END() tt_wait_end()
 
 #define TT_REPORT() tt_report(NULL)
+#define TT_SNAPSHOT() tt_snapshot(NULL)
+
+#else
+
+/* The arguments are only used with sizeof, so they are not evaluated but do
+ * not trigger unused variable warnings either.
+ */
+static inline int tt_nop(size_t unused)
+{
+    (void) unused;
+    return 0;
+}
+
+#define TT_ENTRY(S) tt_nop(sizeof(S))
+#define TT_BEGIN(S) tt_nop(sizeof(S))
+#define TT_END(S) tt_nop(sizeof(S))
+#define TT_BEGIN_CAT(C, S) tt_nop(sizeof(C) + sizeof(S))
+#define TT_END_CAT(C, S) tt_nop(sizeof(C) + sizeof(S))
+#define TT_SCOPE(S) tt_nop(sizeof(S))
+#define TT_SCOPE_CAT(C, S) tt_nop(sizeof(C) + sizeof(S))
+#define TT_ASYNC_BEGIN(ID, S) tt_nop(sizeof(ID) + sizeof(S))
+#define TT_ASYNC_END(ID, S) tt_nop(sizeof(ID) + sizeof(S))
+#define TT_ASYNC_BEGIN_CAT(C, ID, S) tt_nop(sizeof(C) + sizeof(ID) + sizeof(S))
+#define TT_ASYNC_END_CAT(C, ID, S) tt_nop(sizeof(C) + sizeof(ID) + sizeof(S))
+#define TT_FLOW_BEGIN(ID, S) tt_nop(sizeof(ID) + sizeof(S))
+#define TT_FLOW_END(ID, S) tt_nop(sizeof(ID) + sizeof(S))
+#define TT_FLOW_BEGIN_CAT(C, ID, S) tt_nop(sizeof(C) + sizeof(ID) + sizeof(S))
+#define TT_FLOW_END_CAT(C, ID, S) tt_nop(sizeof(C) + sizeof(ID) + sizeof(S))
+#define TT_COUNTER(S, V) tt_nop(sizeof(S) + sizeof(V))
+#define TT_COUNTER_CAT(C, S, V) tt_nop(sizeof(C) + sizeof(S) + sizeof(V))
+#define TT_INSTANT(S) tt_nop(sizeof(S))
+#define TT_INSTANT_CAT(C, S) tt_nop(sizeof(C) + sizeof(S))
+#define TT_WAIT_BEGIN(R) tt_nop(sizeof(R))
+#define TT_WAIT_END() tt_nop(0)
+#define TT_REPORT() tt_nop(0)
+#define TT_SNAPSHOT() tt_nop(0)
+
+#endif
+
+int tt_signin(const char *threadname);
+int tt_stamp(const char *cat, const char *tag, const char *phase);
+int tt_stamp_id(const char *cat,
+                const char *tag,
+                const char *phase,
+                uint64_t id);
+int tt_counter(const char *cat, const char *name, int64_t value);
+void tt_wait_begin(enum tt_wait_reason reason);
+void tt_wait_end(void);
 int tt_report(const char *oname);
+int tt_snapshot(const char *oname);
+
+struct tt_scope {
+    const char *cat;
+    const char *tag;
+};
+
+static inline void tt_scope_end(const struct tt_scope *scope)
+{
+    tt_stamp(scope->cat, scope->tag, "E");
+}
 
 #endif
@@ -0,0 +1,232 @@
+#include "barrier.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+
+#include "cacheline.h"
+#include "futex.h"
+#include "threadtracer.h"
+
+/* The low bit of a futex word says that somebody may be sleeping on it, so
+ * that the thread changing it only makes a system call when it has to.  It
+ * also means that the waker touches the word only once, in the atomic
+ * operation that releases the waiters, which may then free it.
+ */
+#define WAITERS 1u
+
+/* Wait until the phase is no longer 'phase'. */
+static void phase_wait(_Atomic unsigned int *word, unsigned int phase)
+{
+    unsigned int v;
+    for (int i = spin_limit(); i > 0; --i) {
+        v = atomic_load_explicit(word, memory_order_acquire);
+        if ((v & ~WAITERS) != phase)
+            return;
+        spin_pause();
+    }
+
+    TT_WAIT_BEGIN(TT_WAIT_CONDVAR);
+    v = atomic_load_explicit(word, memory_order_acquire);
+    while ((v & ~WAITERS) == phase) {
+        if (!(v & WAITERS) &&
+            !atomic_compare_exchange_weak(word, &v, v | WAITERS))
+            continue;
+        futex_wait(word, phase | WAITERS, NULL);
+        v = atomic_load_explicit(word, memory_order_acquire);
+    }
+    TT_WAIT_END();
+}
+
+/* Move on from 'phase', waking anyone sleeping on it. */
+static void phase_release(_Atomic unsigned int *word, unsigned int phase)
+{
+    if (atomic_exchange(word, phase + 2) & WAITERS)
+        futex_wake(word, INT_MAX);
+}
+
+int barrier_init(barrier_t *b, unsigned int count)
+{
+    if (!count)
+        return EINVAL;
+    atomic_init(&b->count, count);
+    atomic_init(&b->phase, 0);
+    b->total = count;
+    return 0;
+}
+
+int barrier_destroy(barrier_t *b)
+{
+    if (atomic_load(&b->count) != b->total)
+        return EBUSY;
+    return 0;
+}
+
+int barrier_wait(barrier_t *b)
+{
+    /* The phase cannot move on before we have arrived. */
+    const unsigned int phase =
+        atomic_load_explicit(&b->phase, memory_order_relaxed) & ~WAITERS;
+
+    if (atomic_fetch_sub_explicit(&b->count, 1, memory_order_acq_rel) != 1) {
+        phase_wait(&b->phase, phase);
+        return 0;
+    }
+
+    /* We are the last: reset the count for the next phase before anybody
+     * can start it.
+     */
+    atomic_store_explicit(&b->count, b->total, memory_order_relaxed);
+    phase_release(&b->phase, phase);
+    return BARRIER_SERIAL_THREAD;
+}
+
+/* The latch counts in steps of 2, leaving room for the WAITERS flag. */
+
+int latch_init(latch_t *l, unsigned int count)
+{
+    if (count > UINT_MAX / 2)
+        return EINVAL;
+    atomic_init(&l->count, count * 2);
+    return 0;
+}
+
+int latch_destroy(latch_t *l)
+{
+    (void) l;
+    return 0;
+}
+
+void latch_count_down(latch_t *l, unsigned int n)
+{
+    unsigned int v = atomic_load_explicit(&l->count, memory_order_relaxed);
+    unsigned int next;
+    do {
+        if (v / 2 < n)
+            abort();
+        next = v - n * 2;
+        /* Nobody needs to know about waiters once the latch is open. */
+        if (next < 2)
+            next = 0;
+    } while (!atomic_compare_exchange_weak_explicit(
+        &l->count, &v, next, memory_order_release, memory_order_relaxed));
+
+    if (!next && (v & WAITERS))
+        futex_wake(&l->count, INT_MAX);
+}
+
+bool latch_try_wait(latch_t *l)
+{
+    return atomic_load_explicit(&l->count, memory_order_acquire) < 2;
+}
+
+void latch_wait(latch_t *l)
+{
+    unsigned int v;
+    for (int i = spin_limit(); i > 0; --i) {
+        if (latch_try_wait(l))
+            return;
+        spin_pause();
+    }
+
+    TT_WAIT_BEGIN(TT_WAIT_CONDVAR);
+    v = atomic_load_explicit(&l->count, memory_order_acquire);
+    while (v >= 2) {
+        if (!(v & WAITERS) &&
+            !atomic_compare_exchange_weak(&l->count, &v, v | WAITERS))
+            continue;
+        futex_wait(&l->count, v | WAITERS, NULL);
+        v = atomic_load_explicit(&l->count, memory_order_acquire);
+    }
+    TT_WAIT_END();
+}
+
+void latch_arrive_and_wait(latch_t *l, unsigned int n)
+{
+    latch_count_down(l, n);
+    latch_wait(l);
+}
+
+/* How many threads, or child nodes, arrive at each node of a tree_barrier_t.
+ * A few threads can share a cache line without much contention, and a small
+ * fan-in keeps the path from a leaf to the root short enough.
+ */
+#define FANIN 4
+
+struct tree_barrier_node {
+    _Atomic unsigned int count;  /* arrivals yet to come */
+    unsigned int total;
+    int parent;                  /* -1 for the root */
+} __attribute__((aligned(CACHELINE)));
+
+int tree_barrier_init(tree_barrier_t *b, unsigned int count)
+{
+    if (!count)
+        return EINVAL;
+
+    /* The leaves come first, then each level above them, up to the root. */
+    unsigned int numnodes = 0;
+    for (unsigned int n = count; ; n = (n + FANIN - 1) / FANIN) {
+        numnodes += (n + FANIN - 1) / FANIN;
+        if (n <= FANIN)
+            break;
+    }
+
+    struct tree_barrier_node *nodes =
+        aligned_alloc(CACHELINE, numnodes * sizeof(*nodes));
+    if (!nodes)
+        return ENOMEM;
+
+    unsigned int first = 0;
+    for (unsigned int n = count; ; n = (n + FANIN - 1) / FANIN) {
+        const unsigned int level = (n + FANIN - 1) / FANIN;
+        for (unsigned int i = 0; i < level; ++i) {
+            struct tree_barrier_node *node = nodes + first + i;
+            node->total = i < n / FANIN ? FANIN : n % FANIN;
+            atomic_init(&node->count, node->total);
+            node->parent = level == 1 ? -1 : (int) (first + level + i / FANIN);
+        }
+        first += level;
+        if (level == 1)
+            break;
+    }
+
+    b->nodes = nodes;
+    b->numnodes = numnodes;
+    b->total = count;
+    atomic_init(&b->phase, 0);
+    return 0;
+}
+
+int tree_barrier_destroy(tree_barrier_t *b)
+{
+    for (unsigned int i = 0; i < b->numnodes; ++i)
+        if (atomic_load(&b->nodes[i].count) != b->nodes[i].total)
+            return EBUSY;
+    free(b->nodes);
+    return 0;
+}
+
+int tree_barrier_wait(tree_barrier_t *b, unsigned int index)
+{
+    if (index >= b->total)
+        abort();
+
+    const unsigned int phase =
+        atomic_load_explicit(&b->phase, memory_order_relaxed) & ~WAITERS;
+
+    struct tree_barrier_node *node = b->nodes + index / FANIN;
+    while (atomic_fetch_sub_explicit(&node->count, 1, memory_order_acq_rel) ==
+           1) {
+        /* The last to arrive at a node goes on up the tree. */
+        atomic_store_explicit(&node->count, node->total, memory_order_relaxed);
+        if (node->parent < 0) {
+            phase_release(&b->phase, phase);
+            return BARRIER_SERIAL_THREAD;
+        }
+        node = b->nodes + node->parent;
+    }
+
+    phase_wait(&b->phase, phase);
+    return 0;
+}
@@ -0,0 +1,76 @@
+#ifndef FUTEX_H
+#define FUTEX_H
+
+/* Helpers for the primitives that spin for a while, and then park on a futex
+ * in the kernel.  Linux only, and private to the process.
+ */
+
+#include <errno.h>
+#include <linux/futex.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Block while *word is val, until futex_wake, a timeout (relative, NULL for
+ * none), a signal or a spurious wakeup.  Returns 0 or an errno value.
+ */
+static inline int futex_wait(_Atomic unsigned int *word,
+                             unsigned int val,
+                             const struct timespec *timeout)
+{
+    if (syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, val, timeout, NULL, 0))
+        return errno;
+    return 0;
+}
+
+/* Like futex_wait, but with an absolute CLOCK_REALTIME timeout, as for
+ * pthread_cond_timedwait.
+ */
+static inline int futex_wait_until(_Atomic unsigned int *word,
+                                   unsigned int val,
+                                   const struct timespec *abstime)
+{
+    if (!abstime)
+        return futex_wait(word, val, NULL);
+    if (syscall(SYS_futex, word,
+                FUTEX_WAIT_BITSET_PRIVATE | FUTEX_CLOCK_REALTIME, val,
+                abstime, NULL, FUTEX_BITSET_MATCH_ANY))
+        return errno;
+    return 0;
+}
+
+/* Wake up to n threads blocked on word. */
+static inline void futex_wake(_Atomic unsigned int *word, int n)
+{
+    syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0);
+}
+
+/* Tell the CPU that we are spinning. */
+static inline void spin_pause(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ volatile("yield");
+#endif
+}
+
+/* How many times to poll before parking.  Spinning only helps if another CPU
+ * can make progress meanwhile.
+ */
+#define SPIN_LIMIT 4000
+
+static inline int spin_limit(void)
+{
+    static _Atomic int limit = -1;
+    int l = atomic_load_explicit(&limit, memory_order_relaxed);
+    if (l < 0) {
+        l = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? SPIN_LIMIT : 0;
+        atomic_store_explicit(&limit, l, memory_order_relaxed);
+    }
+    return l;
+}
+
+#endif /* FUTEX_H */
@@ -0,0 +1,430 @@
+#include "hashmap.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cacheline.h"
+#include "hazard.h"
+
+/* Entries in a bucket, or in each link of its overflow chain. */
+#define BUCKET_ENTRIES 3
+
+/* Tables start with this many buckets, and double when they hold twice as
+ * many entries as buckets.
+ */
+#define MIN_BUCKETS 16
+#define LOAD_FACTOR 2
+
+/* How many buckets besides its own a thread moves on each update. */
+#define MIGRATE_BATCH 2
+
+/* The hazard slots for the current table, and the one it moves into. */
+#define HAZARD_TABLE 1
+#define HAZARD_NEXT 2
+
+struct hashmap_entry {
+    const void *key; /* NULL if unused */
+    void *value;
+};
+
+struct hashmap_chain {
+    struct hashmap_entry entries[BUCKET_ENTRIES];
+    struct hashmap_chain *next;
+};
+
+/* Entries fill a bucket in order: its own first, then those of each link of
+ * its chain, so that only the last link can have unused entries.
+ */
+struct hashmap_bucket {
+    skinny_mutex_t lock;
+    struct hashmap_chain *chain; /* or MOVED */
+    struct hashmap_entry entries[BUCKET_ENTRIES];
+} __attribute__((aligned(CACHELINE)));
+
+/* The chain of a bucket whose entries have been moved to the next table. */
+#define MOVED ((struct hashmap_chain *) 1)
+
+struct hashmap_table {
+    size_t mask; /* the number of buckets, minus 1 */
+
+    /* The table entries are moving to, once it has been set. */
+    struct hashmap_table *next;
+
+    /* The next bucket for a thread to move, modulo the size. */
+    atomic_size_t migrate_next;
+
+    /* How many buckets have been moved. */
+    atomic_size_t migrated;
+
+    struct hashmap_bucket buckets[];
+};
+
+static uint64_t pointer_hash(const void *key)
+{
+    /* Multiplicative hashing, keeping the well mixed high bits. */
+    uint64_t h = (uintptr_t) key * 0x9e3779b97f4a7c15ull;
+    return h ^ (h >> 32);
+}
+
+static bool pointer_equal(const void *a, const void *b)
+{
+    return a == b;
+}
+
+static struct hashmap_table *table_create(size_t size)
+{
+    struct hashmap_table *t =
+        aligned_alloc(CACHELINE, sizeof(*t) + size * sizeof(t->buckets[0]));
+    if (!t)
+        return NULL;
+
+    t->mask = size - 1;
+    t->next = NULL;
+    atomic_init(&t->migrate_next, 0);
+    atomic_init(&t->migrated, 0);
+    memset(t->buckets, 0, size * sizeof(t->buckets[0]));
+    for (size_t i = 0; i < size; ++i)
+        skinny_mutex_init(&t->buckets[i].lock);
+    return t;
+}
+
+static void table_free(void *v_table)
+{
+    struct hashmap_table *t = v_table;
+
+    for (size_t i = 0; i <= t->mask; ++i) {
+        struct hashmap_chain *chain = t->buckets[i].chain;
+        if (chain == MOVED)
+            continue;
+        while (chain) {
+            struct hashmap_chain *next = chain->next;
+            free(chain);
+            chain = next;
+        }
+    }
+    free(t);
+}
+
+/* Walks the entries of a bucket, in order. */
+struct bucket_iter {
+    struct hashmap_entry *entries;
+    struct hashmap_chain *chain;
+    int i;
+};
+
+static void bucket_iter_init(struct bucket_iter *it, struct hashmap_bucket *b)
+{
+    it->entries = b->entries;
+    it->chain = b->chain;
+    it->i = 0;
+}
+
+static struct hashmap_entry *bucket_iter_next(struct bucket_iter *it)
+{
+    if (it->i == BUCKET_ENTRIES) {
+        if (!it->chain)
+            return NULL;
+        it->entries = it->chain->entries;
+        it->chain = it->chain->next;
+        it->i = 0;
+    }
+    struct hashmap_entry *e = &it->entries[it->i++];
+    return e->key ? e : NULL;
+}
+
+static struct hashmap_entry *bucket_find(hashmap_t *map,
+                                         struct hashmap_bucket *b,
+                                         const void *key)
+{
+    struct bucket_iter it;
+    struct hashmap_entry *e;
+
+    bucket_iter_init(&it, b);
+    while ((e = bucket_iter_next(&it)))
+        if (map->equal(e->key, key))
+            return e;
+    return NULL;
+}
+
+/* Add an entry to a bucket, which must not have the key already.  Sets
+ * *chained if it had to extend the chain.
+ */
+static int bucket_add(struct hashmap_bucket *b,
+                      const void *key,
+                      void *value,
+                      bool *chained)
+{
+    struct hashmap_entry *entries = b->entries;
+    struct hashmap_chain **link = &b->chain;
+
+    *chained = false;
+    for (;;) {
+        for (int i = 0; i < BUCKET_ENTRIES; ++i)
+            if (!entries[i].key) {
+                entries[i] = (struct hashmap_entry){key, value};
+                return 0;
+            }
+
+        if (!*link) {
+            *link = calloc(1, sizeof(**link));
+            if (!*link)
+                return ENOMEM;
+            *chained = true;
+        }
+        entries = (*link)->entries;
+        link = &(*link)->next;
+    }
+}
+
+/* Remove an entry from a bucket, by moving the last entry into its place. */
+static void bucket_remove(struct hashmap_bucket *b, struct hashmap_entry *e)
+{
+    struct hashmap_entry *entries = b->entries;
+    struct hashmap_chain **link = NULL;
+
+    if (b->chain) {
+        link = &b->chain;
+        while ((*link)->next)
+            link = &(*link)->next;
+        entries = (*link)->entries;
+    }
+
+    int last = BUCKET_ENTRIES - 1;
+    while (!entries[last].key)
+        last--;
+    *e = entries[last];
+    entries[last].key = NULL;
+
+    if (link && !last) {
+        /* The last link is empty now. */
+        free(*link);
+        *link = NULL;
+    }
+}
+
+/* Lock the bucket that key should be in, in whichever table it is now.  On
+ * return the tables are protected by hazard pointers, to clear after
+ * unlocking it.
+ */
+static struct hashmap_bucket *lock_bucket(hashmap_t *map, uint64_t hash)
+{
+    for (;;) {
+        struct hashmap_table *t =
+            hazard_protect(HAZARD_TABLE, (void **) &map->current);
+        struct hashmap_bucket *b = &t->buckets[hash & t->mask];
+        skinny_mutex_lock(&b->lock);
+        if (b->chain != MOVED)
+            return b;
+        skinny_mutex_unlock(&b->lock);
+
+        /* It has moved to the next table.  That can only be freed once it
+         * has become current and then been replaced in turn.
+         */
+        struct hashmap_table *n = __atomic_load_n(&t->next, __ATOMIC_ACQUIRE);
+        hazard_set(HAZARD_NEXT, n);
+        struct hashmap_table *cur = __atomic_load_n(&map->current,
+                                                    __ATOMIC_SEQ_CST);
+        if (cur != t && cur != n)
+            continue;
+
+        b = &n->buckets[hash & n->mask];
+        skinny_mutex_lock(&b->lock);
+        if (b->chain != MOVED)
+            return b;
+        skinny_mutex_unlock(&b->lock);
+    }
+}
+
+static void unlock_bucket(struct hashmap_bucket *b)
+{
+    skinny_mutex_unlock(&b->lock);
+    hazard_clear(HAZARD_NEXT);
+    hazard_clear(HAZARD_TABLE);
+}
+
+/* Move the entries of bucket i of t, which is protected, to the next table.
+ */
+static void migrate_bucket(hashmap_t *map,
+                           struct hashmap_table *t,
+                           struct hashmap_table *n,
+                           size_t i)
+{
+    struct hashmap_bucket *b = &t->buckets[i];
+    skinny_mutex_lock(&b->lock);
+    if (b->chain == MOVED) {
+        skinny_mutex_unlock(&b->lock);
+        return;
+    }
+
+    /* While b is unmoved and locked, nobody else looks for its keys in n,
+     * and n cannot start moving to another table.  Until b is marked moved,
+     * its entries must stay where they are, so on failure the copies are
+     * taken out of n again.
+     */
+    struct bucket_iter it;
+    struct hashmap_entry *e;
+    size_t moved = 0;
+    int res = 0;
+
+    bucket_iter_init(&it, b);
+    while (!res && (e = bucket_iter_next(&it))) {
+        struct hashmap_bucket *nb = &n->buckets[map->hash(e->key) & n->mask];
+        bool chained;
+        skinny_mutex_lock(&nb->lock);
+        res = bucket_add(nb, e->key, e->value, &chained);
+        skinny_mutex_unlock(&nb->lock);
+        moved += !res;
+    }
+
+    if (res) {
+        bucket_iter_init(&it, b);
+        for (; moved; --moved) {
+            e = bucket_iter_next(&it);
+            struct hashmap_bucket *nb =
+                &n->buckets[map->hash(e->key) & n->mask];
+            skinny_mutex_lock(&nb->lock);
+            bucket_remove(nb, bucket_find(map, nb, e->key));
+            skinny_mutex_unlock(&nb->lock);
+        }
+        skinny_mutex_unlock(&b->lock);
+        return;
+    }
+
+    struct hashmap_chain *chain = b->chain;
+    b->chain = MOVED;
+    skinny_mutex_unlock(&b->lock);
+    while (chain) {
+        struct hashmap_chain *next = chain->next;
+        free(chain);
+        chain = next;
+    }
+
+    if (atomic_fetch_add(&t->migrated, 1) == t->mask) {
+        /* That was the last one, so n takes over. */
+        __atomic_store_n(&map->current, n, __ATOMIC_SEQ_CST);
+        hazard_retire(t, table_free);
+    }
+}
+
+/* If the map is moving to a bigger table, move key's bucket and a few more.
+ */
+static void help_migrate(hashmap_t *map, uint64_t hash)
+{
+    struct hashmap_table *t =
+        hazard_protect(HAZARD_TABLE, (void **) &map->current);
+    struct hashmap_table *n = __atomic_load_n(&t->next, __ATOMIC_ACQUIRE);
+    if (n) {
+        migrate_bucket(map, t, n, hash & t->mask);
+        size_t i = atomic_fetch_add(&t->migrate_next, MIGRATE_BATCH);
+        for (int j = 0; j < MIGRATE_BATCH; ++j)
+            migrate_bucket(map, t, n, (i + j) & t->mask);
+    }
+    hazard_clear(HAZARD_TABLE);
+}
+
+/* Start moving to a bigger table, if the map has grown enough. */
+static void maybe_grow(hashmap_t *map)
+{
+    struct hashmap_table *t =
+        hazard_protect(HAZARD_TABLE, (void **) &map->current);
+    const size_t size = t->mask + 1;
+    if (!__atomic_load_n(&t->next, __ATOMIC_ACQUIRE) &&
+        percpu_counter_read(&map->count) > (int64_t) (size * LOAD_FACTOR)) {
+        skinny_mutex_lock(&map->resize_lock);
+        if (__atomic_load_n(&map->current, __ATOMIC_ACQUIRE) == t &&
+            !t->next) {
+            struct hashmap_table *n = table_create(size * 2);
+            if (n)
+                __atomic_store_n(&t->next, n, __ATOMIC_RELEASE);
+        }
+        skinny_mutex_unlock(&map->resize_lock);
+    }
+    hazard_clear(HAZARD_TABLE);
+}
+
+int hashmap_init(hashmap_t *map,
+                 uint64_t (*hash)(const void *key),
+                 bool (*equal)(const void *a, const void *b))
+{
+    map->hash = hash ? hash : pointer_hash;
+    map->equal = equal ? equal : pointer_equal;
+    skinny_mutex_init(&map->resize_lock);
+    int res = percpu_counter_init(&map->count);
+    if (res)
+        return res;
+    map->current = table_create(MIN_BUCKETS);
+    if (!map->current) {
+        percpu_counter_destroy(&map->count);
+        return ENOMEM;
+    }
+    return 0;
+}
+
+void hashmap_destroy(hashmap_t *map)
+{
+    if (map->current->next)
+        table_free(map->current->next);
+    table_free(map->current);
+    percpu_counter_destroy(&map->count);
+    skinny_mutex_destroy(&map->resize_lock);
+}
+
+void *hashmap_get(hashmap_t *map, const void *key)
+{
+    struct hashmap_bucket *b = lock_bucket(map, map->hash(key));
+    struct hashmap_entry *e = bucket_find(map, b, key);
+    void *value = e ? e->value : NULL;
+    unlock_bucket(b);
+    return value;
+}
+
+int hashmap_put(hashmap_t *map, const void *key, void *value)
+{
+    const uint64_t hash = map->hash(key);
+    bool chained = false;
+    int res = 0;
+
+    help_migrate(map, hash);
+    struct hashmap_bucket *b = lock_bucket(map, hash);
+    struct hashmap_entry *e = bucket_find(map, b, key);
+    if (e)
+        e->value = value;
+    else
+        res = bucket_add(b, key, value, &chained);
+    unlock_bucket(b);
+
+    if (!e && !res)
+        percpu_counter_add(&map->count, 1);
+    if (chained)
+        maybe_grow(map);
+    return res;
+}
+
+void *hashmap_remove(hashmap_t *map, const void *key)
+{
+    const uint64_t hash = map->hash(key);
+    void *value = NULL;
+
+    help_migrate(map, hash);
+    struct hashmap_bucket *b = lock_bucket(map, hash);
+    struct hashmap_entry *e = bucket_find(map, b, key);
+    if (e) {
+        value = e->value;
+        bucket_remove(b, e);
+    }
+    unlock_bucket(b);
+
+    if (e)
+        percpu_counter_add(&map->count, -1);
+    return value;
+}
+
+size_t hashmap_count(hashmap_t *map)
+{
+    /* Slots are read one at a time, so a removal can be seen without the
+     * addition before it.
+     */
+    int64_t count = percpu_counter_read(&map->count);
+    return count > 0 ? count : 0;
+}
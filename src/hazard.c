@@ -0,0 +1,217 @@
+#include "hazard.h"
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "cacheline.h"
+#include "thread.h"
+
+/* A thread scans its retired objects once it has this many, or twice the
+ * number of hazard slots in use, whichever is more.  So each scan frees at
+ * least half of them.
+ */
+#define HAZARD_MIN_RETIRED 64
+
+struct retired {
+    void *p;
+    void (*free_fn)(void *p);
+};
+
+/* The hazard slots of a thread, and the objects that it has retired. */
+struct hazard_record {
+    _Atomic(void *) slots[HAZARD_SLOTS];
+
+    /* Set while a thread owns the record. */
+    atomic_bool active;
+
+    /* Records are never freed, so the list only ever grows at its head. */
+    struct hazard_record *next;
+
+    /* Only touched by the owning thread. */
+    struct retired *retired;
+    size_t numretired;
+    size_t maxretired;
+} __attribute__((aligned(CACHELINE)));
+
+static _Atomic(struct hazard_record *) records;
+static atomic_uint numrecords;
+
+static void record_release(void *v_record);
+
+TLS_VAR_DECLARE_STATIC_DTOR(tls_hazard_record, record_release);
+
+/* A cached thread gives its record back between functions, as the key
+ * destructor would if it exited, so that what it retired is not held up
+ * while it is parked.
+ */
+static void record_reset(void)
+{
+    struct hazard_record *record = TLS_VAR_GET(tls_hazard_record);
+    if (record)
+        record_release(record);
+}
+
+static pthread_once_t record_reset_once = PTHREAD_ONCE_INIT;
+
+static void record_reset_once_func(void)
+{
+    thread_on_reuse(record_reset);
+}
+
+/* Take over a record given back by an exited thread, or make a new one. */
+static struct hazard_record *record_acquire(void)
+{
+    struct hazard_record *record;
+
+    pthread_once(&record_reset_once, record_reset_once_func);
+
+    for (record = atomic_load(&records); record; record = record->next) {
+        bool active = false;
+        if (!atomic_load_explicit(&record->active, memory_order_relaxed) &&
+            atomic_compare_exchange_strong(&record->active, &active, true))
+            break;
+    }
+
+    if (!record) {
+        record = aligned_alloc(CACHELINE, sizeof(*record));
+        if (!record)
+            abort();
+        for (int i = 0; i < HAZARD_SLOTS; ++i)
+            atomic_init(&record->slots[i], NULL);
+        atomic_init(&record->active, true);
+        record->retired = NULL;
+        record->numretired = record->maxretired = 0;
+        record->next = atomic_load(&records);
+        while (!atomic_compare_exchange_weak(&records, &record->next, record))
+            ;
+        atomic_fetch_add(&numrecords, 1);
+    }
+
+    TLS_VAR_SET(tls_hazard_record, record);
+    return record;
+}
+
+static inline struct hazard_record *record_get(void)
+{
+    struct hazard_record *record = TLS_VAR_GET(tls_hazard_record);
+    return record ? record : record_acquire();
+}
+
+void hazard_set(unsigned int slot, void *p)
+{
+    /* A seq_cst store alone does not order the caller's plain loads after
+     * it, so fence as the header promises.
+     */
+    atomic_store(&record_get()->slots[slot], p);
+    atomic_thread_fence(memory_order_seq_cst);
+}
+
+void *hazard_protect(unsigned int slot, void **src)
+{
+    struct hazard_record *record = record_get();
+    void *p = __atomic_load_n(src, __ATOMIC_ACQUIRE);
+    for (;;) {
+        atomic_store(&record->slots[slot], p);
+        void *q = __atomic_load_n(src, __ATOMIC_SEQ_CST);
+        if (q == p)
+            return p;
+        p = q;
+    }
+}
+
+void hazard_clear(unsigned int slot)
+{
+    atomic_store_explicit(&record_get()->slots[slot], NULL,
+                          memory_order_release);
+}
+
+static int compare_pointers(const void *a, const void *b)
+{
+    const void *pa = *(void *const *) a, *pb = *(void *const *) b;
+    return pa < pb ? -1 : pa > pb;
+}
+
+static void record_scan(struct hazard_record *record)
+{
+    /* Records added after we look at the head can only protect objects that
+     * were still reachable then, so not ours.
+     */
+    struct hazard_record *head = atomic_load(&records);
+    size_t maxhazards = 0;
+    for (struct hazard_record *r = head; r; r = r->next)
+        maxhazards += HAZARD_SLOTS;
+    void **hazards = malloc(maxhazards * sizeof(*hazards));
+    if (!hazards)
+        return;
+
+    atomic_thread_fence(memory_order_seq_cst);
+    size_t numhazards = 0;
+    for (struct hazard_record *r = head; r; r = r->next)
+        for (int i = 0; i < HAZARD_SLOTS; ++i) {
+            void *p = atomic_load(&r->slots[i]);
+            if (p)
+                hazards[numhazards++] = p;
+        }
+    qsort(hazards, numhazards, sizeof(*hazards), compare_pointers);
+
+    size_t kept = 0;
+    for (size_t i = 0; i < record->numretired; ++i) {
+        struct retired *r = &record->retired[i];
+        if (bsearch(&r->p, hazards, numhazards, sizeof(*hazards),
+                    compare_pointers))
+            record->retired[kept++] = *r;
+        else
+            r->free_fn(r->p);
+    }
+    record->numretired = kept;
+    free(hazards);
+}
+
+void hazard_retire(void *p, void (*free_fn)(void *p))
+{
+    struct hazard_record *record = record_get();
+
+    if (record->numretired == record->maxretired) {
+        size_t max = record->maxretired ? record->maxretired * 2
+                                        : HAZARD_MIN_RETIRED;
+        struct retired *retired =
+            realloc(record->retired, max * sizeof(*retired));
+        if (!retired) {
+            /* Wait for it to be unprotected, then. */
+            while (record->numretired == record->maxretired)
+                record_scan(record);
+        } else {
+            record->retired = retired;
+            record->maxretired = max;
+        }
+    }
+    record->retired[record->numretired++] = (struct retired){p, free_fn};
+
+    size_t threshold = 2 * HAZARD_SLOTS * atomic_load(&numrecords);
+    if (threshold < HAZARD_MIN_RETIRED)
+        threshold = HAZARD_MIN_RETIRED;
+    if (record->numretired >= threshold)
+        record_scan(record);
+}
+
+void hazard_scan(void)
+{
+    struct hazard_record *record = TLS_VAR_GET(tls_hazard_record);
+    if (record)
+        record_scan(record);
+}
+
+/* Give the record back when a thread exits.  What it could not free yet is
+ * left for the next owner.
+ */
+static void record_release(void *v_record)
+{
+    struct hazard_record *record = v_record;
+
+    for (int i = 0; i < HAZARD_SLOTS; ++i)
+        atomic_store(&record->slots[i], NULL);
+    record_scan(record);
+    TLS_VAR_SET(tls_hazard_record, NULL);
+    atomic_store(&record->active, false);
+}
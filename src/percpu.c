@@ -0,0 +1,65 @@
+#include "percpu.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/sysinfo.h>
+
+unsigned int percpu_slots;
+unsigned int percpu_rseq_slots;
+
+static pthread_once_t percpu_once = PTHREAD_ONCE_INIT;
+static atomic_uint next_thread_slot;
+static __thread unsigned int thread_slot;
+
+static void percpu_once_func(void)
+{
+    int n = get_nprocs_conf();
+    percpu_slots = n > 0 ? n : 1;
+#ifdef PERCPU_RSEQ
+    /* glibc registers an rseq area for each thread, unless the kernel lacks
+     * rseq or registration was turned off.
+     */
+    if (__rseq_size)
+        percpu_rseq_slots = percpu_slots;
+#endif
+}
+
+int percpu_counter_init(percpu_counter_t *c)
+{
+    pthread_once(&percpu_once, percpu_once_func);
+
+    const size_t size =
+        (percpu_slots + PERCPU_THREAD_SLOTS) * sizeof(struct percpu_slot);
+    c->slots = aligned_alloc(sizeof(struct percpu_slot), size);
+    if (!c->slots)
+        return ENOMEM;
+    memset(c->slots, 0, size);
+    return 0;
+}
+
+void percpu_counter_destroy(percpu_counter_t *c)
+{
+    free(c->slots);
+    c->slots = NULL;
+}
+
+void percpu_counter_add_slow(percpu_counter_t *c, int64_t v)
+{
+    /* Threads take the slots in turn; 0 means not chosen yet. */
+    if (!thread_slot)
+        thread_slot = atomic_fetch_add(&next_thread_slot, 1) %
+                          PERCPU_THREAD_SLOTS +
+                      1;
+    struct percpu_slot *slot = c->slots + percpu_slots + thread_slot - 1;
+    atomic_fetch_add_explicit(&slot->value, v, memory_order_relaxed);
+}
+
+int64_t percpu_counter_read(percpu_counter_t *c)
+{
+    int64_t sum = 0;
+    for (unsigned int i = 0; i < percpu_slots + PERCPU_THREAD_SLOTS; ++i)
+        sum += atomic_load_explicit(&c->slots[i].value, memory_order_relaxed);
+    return sum;
+}
@@ -0,0 +1,296 @@
+#include "ring.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* An mpsc_ring_t slot is its sequence number, followed by the element.  The
+ * sequence number is its position in the ring plus 1 once an element at that
+ * position has been pushed into it, and the position of the next lap round
+ * the ring once it has been popped.
+ */
+#define SEQ_SIZE sizeof(_Atomic size_t)
+
+static int ring_alloc(char **buf,
+                      size_t *mask,
+                      size_t capacity,
+                      size_t elem_size)
+{
+    if (!capacity || !elem_size || capacity > SIZE_MAX / 2)
+        return EINVAL;
+
+    size_t size = 1;
+    while (size < capacity)
+        size *= 2;
+    if (elem_size > SIZE_MAX / size - CACHELINE)
+        return ENOMEM;
+
+    /* aligned_alloc wants a multiple of the alignment. */
+    *buf = aligned_alloc(CACHELINE,
+                         (size * elem_size + CACHELINE - 1) &
+                             ~(size_t) (CACHELINE - 1));
+    if (!*buf)
+        return ENOMEM;
+    *mask = size - 1;
+    return 0;
+}
+
+int spsc_ring_init(spsc_ring_t *r,
+                   size_t capacity,
+                   size_t elem_size,
+                   int flags)
+{
+    int res = ring_alloc(&r->buf, &r->mask, capacity, elem_size);
+    if (res)
+        return res;
+
+    atomic_init(&r->prod.tail, 0);
+    r->prod.head_cache = 0;
+    atomic_init(&r->cons.head, 0);
+    r->cons.tail_cache = 0;
+    r->elem_size = elem_size;
+    r->blocking = flags & RING_BLOCKING;
+    eventcount_init(&r->not_empty);
+    eventcount_init(&r->not_full);
+    return 0;
+}
+
+void spsc_ring_destroy(spsc_ring_t *r)
+{
+    eventcount_fini(&r->not_full);
+    eventcount_fini(&r->not_empty);
+    free(r->buf);
+}
+
+size_t spsc_ring_push(spsc_ring_t *r, const void *elems, size_t n)
+{
+    const size_t tail =
+        atomic_load_explicit(&r->prod.tail, memory_order_relaxed);
+    const size_t capacity = r->mask + 1;
+
+    /* Only look at the consumer's cache line if the ring looks too full. */
+    if (r->prod.head_cache + capacity - tail < n)
+        r->prod.head_cache =
+            atomic_load_explicit(&r->cons.head, memory_order_acquire);
+    size_t room = r->prod.head_cache + capacity - tail;
+    if (n > room)
+        n = room;
+    if (!n)
+        return 0;
+
+    /* Copy in two parts if the elements wrap round the end. */
+    const size_t i = tail & r->mask;
+    const size_t first = n < capacity - i ? n : capacity - i;
+    memcpy(r->buf + i * r->elem_size, elems, first * r->elem_size);
+    memcpy(r->buf, (const char *) elems + first * r->elem_size,
+           (n - first) * r->elem_size);
+
+    atomic_store_explicit(&r->prod.tail, tail + n, memory_order_release);
+    if (r->blocking)
+        eventcount_notify(&r->not_empty);
+    return n;
+}
+
+size_t spsc_ring_pop(spsc_ring_t *r, void *elems, size_t n)
+{
+    const size_t head =
+        atomic_load_explicit(&r->cons.head, memory_order_relaxed);
+    const size_t capacity = r->mask + 1;
+
+    if (r->cons.tail_cache - head < n)
+        r->cons.tail_cache =
+            atomic_load_explicit(&r->prod.tail, memory_order_acquire);
+    size_t avail = r->cons.tail_cache - head;
+    if (n > avail)
+        n = avail;
+    if (!n)
+        return 0;
+
+    const size_t i = head & r->mask;
+    const size_t first = n < capacity - i ? n : capacity - i;
+    memcpy(elems, r->buf + i * r->elem_size, first * r->elem_size);
+    memcpy((char *) elems + first * r->elem_size, r->buf,
+           (n - first) * r->elem_size);
+
+    atomic_store_explicit(&r->cons.head, head + n, memory_order_release);
+    if (r->blocking)
+        eventcount_notify(&r->not_full);
+    return n;
+}
+
+void spsc_ring_push_wait(spsc_ring_t *r, const void *elems, size_t n)
+{
+    const char *p = elems;
+
+    assert(r->blocking);
+    while (n) {
+        size_t pushed = spsc_ring_push(r, p, n);
+        if (!pushed) {
+            unsigned int key = eventcount_prepare_wait(&r->not_full);
+            pushed = spsc_ring_push(r, p, n);
+            if (!pushed) {
+                eventcount_commit_wait(&r->not_full, key);
+                continue;
+            }
+            eventcount_cancel_wait(&r->not_full);
+        }
+        p += pushed * r->elem_size;
+        n -= pushed;
+    }
+}
+
+size_t spsc_ring_pop_wait(spsc_ring_t *r, void *elems, size_t n)
+{
+    assert(r->blocking);
+    for (;;) {
+        size_t popped = spsc_ring_pop(r, elems, n);
+        if (popped)
+            return popped;
+        unsigned int key = eventcount_prepare_wait(&r->not_empty);
+        popped = spsc_ring_pop(r, elems, n);
+        if (popped) {
+            eventcount_cancel_wait(&r->not_empty);
+            return popped;
+        }
+        eventcount_commit_wait(&r->not_empty, key);
+    }
+}
+
+static inline _Atomic size_t *slot_seq(mpsc_ring_t *r, size_t pos)
+{
+    return (_Atomic size_t *) (r->slots + (pos & r->mask) * r->slot_size);
+}
+
+static inline char *slot_elem(mpsc_ring_t *r, size_t pos)
+{
+    return r->slots + (pos & r->mask) * r->slot_size + SEQ_SIZE;
+}
+
+int mpsc_ring_init(mpsc_ring_t *r,
+                   size_t capacity,
+                   size_t elem_size,
+                   int flags)
+{
+    if (!elem_size || elem_size > SIZE_MAX / 2)
+        return EINVAL;
+
+    /* Keep the sequence numbers aligned. */
+    r->slot_size = (SEQ_SIZE + elem_size + SEQ_SIZE - 1) & ~(SEQ_SIZE - 1);
+    int res = ring_alloc(&r->slots, &r->mask, capacity, r->slot_size);
+    if (res)
+        return res;
+
+    for (size_t pos = 0; pos <= r->mask; ++pos)
+        atomic_init(slot_seq(r, pos), pos);
+    atomic_init(&r->prod.tail, 0);
+    r->cons.head = 0;
+    r->elem_size = elem_size;
+    r->blocking = flags & RING_BLOCKING;
+    eventcount_init(&r->not_empty);
+    eventcount_init(&r->not_full);
+    return 0;
+}
+
+void mpsc_ring_destroy(mpsc_ring_t *r)
+{
+    eventcount_fini(&r->not_full);
+    eventcount_fini(&r->not_empty);
+    free(r->slots);
+}
+
+bool mpsc_ring_push(mpsc_ring_t *r, const void *elems, size_t n)
+{
+    if (n > r->mask + 1)
+        return false;
+    if (!n)
+        return true;
+
+    /* The consumer frees slots in order, so if the last of the n slots from
+     * the tail is free for this lap, so are the others.
+     */
+    size_t tail = atomic_load_explicit(&r->prod.tail, memory_order_relaxed);
+    for (;;) {
+        const size_t last = tail + n - 1;
+        const size_t seq =
+            atomic_load_explicit(slot_seq(r, last), memory_order_acquire);
+        const intptr_t diff = (intptr_t) (seq - last);
+        if (diff < 0)
+            return false; /* still holds an element from the last lap */
+        if (!diff) {
+            if (atomic_compare_exchange_weak_explicit(
+                    &r->prod.tail, &tail, tail + n, memory_order_relaxed,
+                    memory_order_relaxed))
+                break;
+        } else {
+            /* Another producer has claimed it. */
+            tail = atomic_load_explicit(&r->prod.tail, memory_order_relaxed);
+        }
+    }
+
+    const char *p = elems;
+    for (size_t pos = tail; pos < tail + n; ++pos) {
+        memcpy(slot_elem(r, pos), p, r->elem_size);
+        p += r->elem_size;
+        atomic_store_explicit(slot_seq(r, pos), pos + 1, memory_order_release);
+    }
+    if (r->blocking)
+        eventcount_notify(&r->not_empty);
+    return true;
+}
+
+size_t mpsc_ring_pop(mpsc_ring_t *r, void *elems, size_t n)
+{
+    const size_t head = r->cons.head;
+    char *p = elems;
+    size_t popped;
+
+    for (popped = 0; popped < n; ++popped) {
+        const size_t pos = head + popped;
+        if (atomic_load_explicit(slot_seq(r, pos), memory_order_acquire) !=
+            pos + 1)
+            break;
+        memcpy(p, slot_elem(r, pos), r->elem_size);
+        p += r->elem_size;
+        atomic_store_explicit(slot_seq(r, pos), pos + r->mask + 1,
+                              memory_order_release);
+    }
+
+    r->cons.head = head + popped;
+    if (popped && r->blocking)
+        eventcount_notify_all(&r->not_full);
+    return popped;
+}
+
+void mpsc_ring_push_wait(mpsc_ring_t *r, const void *elems, size_t n)
+{
+    assert(r->blocking && n <= r->mask + 1);
+    for (;;) {
+        if (mpsc_ring_push(r, elems, n))
+            return;
+        unsigned int key = eventcount_prepare_wait(&r->not_full);
+        if (mpsc_ring_push(r, elems, n)) {
+            eventcount_cancel_wait(&r->not_full);
+            return;
+        }
+        eventcount_commit_wait(&r->not_full, key);
+    }
+}
+
+size_t mpsc_ring_pop_wait(mpsc_ring_t *r, void *elems, size_t n)
+{
+    assert(r->blocking);
+    for (;;) {
+        size_t popped = mpsc_ring_pop(r, elems, n);
+        if (popped)
+            return popped;
+        unsigned int key = eventcount_prepare_wait(&r->not_empty);
+        popped = mpsc_ring_pop(r, elems, n);
+        if (popped) {
+            eventcount_cancel_wait(&r->not_empty);
+            return popped;
+        }
+        eventcount_commit_wait(&r->not_empty, key);
+    }
+}
@@ -10,7 +10,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+#include "hazard.h"
 #include "logger.h"
+#include "threadtracer.h"
 
 #define CAS(p, a, b) __sync_bool_compare_and_swap(p, a, b)
 
@@ -86,11 +88,11 @@ struct fat_mutex {
      *
      * - References from threads waiting to acquire the mutex.
      *
-     * - References from pegs (see below) not on the primary chain (another
-     *   way of looking at it is that we do include the reference from the
-     *   primary chain, which could be the one from the skinny_mutex, but we
-     *   offset the refcount value by -1, so a refcount of 0 means we only
-     *   have the primary chain).
+     * - With SKINNY_MUTEX_PEGGING, references from pegs (see below) not on
+     *   the primary chain (another way of looking at it is that we do include
+     *   the reference from the primary chain, which could be the one from the
+     *   skinny_mutex, but we offset the refcount value by -1, so a refcount of
+     *   0 means we only have the primary chain).
      *
      * - A pseudo-reference from the thread holding the skinny_mutex (this
      *   might not correspond to an explicit reference, but keeps the fat_mutex
@@ -110,6 +112,11 @@ struct fat_mutex {
     /* Transfer generation. */
     long transfer_gen;
     long transfers;
+
+    /* Set when the skinny_mutex no longer points to the fat_mutex, which is
+     * only waiting for hazard pointers to it to go away before being freed.
+     */
+    bool dead;
 };
 
 /*
@@ -118,23 +125,26 @@ struct fat_mutex {
  * the fat_mutex between those two points.  There needs to be some way
  * for a thread to communicate its intent to access the fat_mutex.
  *
- * Many lock-free algoithms solve this problem using hazard pointers.
- * But hazard pointers require tracking the set of all threads
- * involved.  Furthermore, for efficiency, hazard pointer
- * implementations batch deallocations, and process a batch using a
- * data structure that allows efficient comparison of a candidate
- * pointer with the set of hazard pointers.  Implementing all this
- * involves a substantial amount of code.
+ * Many lock-free algoithms solve this problem using hazard pointers,
+ * and so do we (see hazard.h, which tracks the threads involved and
+ * batches the deallocations).  A thread publishes the pointer it read
+ * from the skinny_mutex as a hazard, and checks that the skinny_mutex
+ * still holds it.  Then it can lock the fat_mutex's pthreads mutex.
+ * fat_mutex_release marks the fat_mutex dead when it clears the
+ * skinny_mutex, and retires it rather than freeing it, so a thread
+ * that gets the lock of a dead fat_mutex just starts again.  Once it
+ * holds the lock, the thread clears its hazard pointer: the refcount
+ * takes over from there, as with pegs.
+ *
+ * Pegging, below, is the older approach, and can be selected by
+ * defining SKINNY_MUTEX_PEGGING.  It needs no tracking of threads,
+ * but has higher per-access costs: under contention, each access
+ * allocates a peg, installs it with a CAS, walks the chain and then
+ * unwinds refcounts.
  *
- * We use a simpler approach: Pegging.  This approach has higher
- * per-access costs than hazard pointers, but we only access the
- * fat_mutex when other significant costs are involved (e.g. blocking
- * the thread on a pthreds mutex), so the cost of this part is likely
- * to be marginal.
-
  * A thread indicates its intent to access the fat_mutex by allocating
  * a peg struct and storing a pointer to it into the skinny_mutex,
- * replacing the pointer to the fat_mutex (see fat_mutex_peg).  The
+ * replacing the pointer to the fat_mutex (see fat_mutex_access).  The
  * skinny_mutex is updated with CAS so that installing a peg is
  * atomic.  A fat_mutex can only be freed if the skinny_mutex points
  * directly to it, so the presence of the peg prevents it being freed,
@@ -154,7 +164,7 @@ struct fat_mutex {
  *                    +--------+   +--------+
  *
  * During the process of releasing a peg (in the second half of
- * fat_mutex_peg), the skinny_mutex is set to point to the fat_mutex
+ * fat_mutex_access), the skinny_mutex is set to point to the fat_mutex
  * again, possibly leaving chains which of pegs which do not originate
  * at the skinny_mutex (these are accounted for in the fat_mutex's
  * refcount, so the pegs on these chains still prevent the fat_mutex
@@ -184,6 +194,8 @@ struct fat_mutex {
  *                                 |   ...  |
  *                                 +--------+
  */
+#ifdef SKINNY_MUTEX_PEGGING
+
 struct peg {
     struct common common;
 
@@ -209,9 +221,9 @@ struct peg {
  * Returns 0 on success, a positive error code, or <0 if the
  * skinny_mutex was found to no longer contain a pointer.
  */
-static int fat_mutex_peg(skinny_mutex_t *skinny,
-                         struct common *p,
-                         struct fat_mutex **fatp)
+static int fat_mutex_access(skinny_mutex_t *skinny,
+                            struct common *p,
+                            struct fat_mutex **fatp)
 {
     int res;
     volatile unsigned int peg_refcount_decr;
@@ -325,6 +337,55 @@ static int fat_mutex_peg(skinny_mutex_t *skinny,
     return res;
 }
 
+#else
+
+static int fat_mutex_access(skinny_mutex_t *skinny,
+                            struct common *p,
+                            struct fat_mutex **fatp)
+{
+    int res;
+    struct fat_mutex *fat;
+
+    for (;;) {
+        hazard_set(0, p);
+        struct common *q = __atomic_load_n(&skinny->val, __ATOMIC_SEQ_CST);
+        if (q != p) {
+            /* value in the skinny_mutex has changed from what we saw. */
+            p = q;
+            if ((uintptr_t) p <= 1)
+                break;
+            continue;
+        }
+
+        /* The fat_mutex cannot be freed now, but might have been released
+         * since we read the skinny_mutex.
+         */
+        fat = (struct fat_mutex *) p;
+        res = pthread_mutex_lock(&fat->mutex);
+        if (res) {
+            hazard_clear(0);
+            return res;
+        }
+        if (!fat->dead) {
+            /* Holding its lock keeps it alive from here on. */
+            hazard_clear(0);
+            *fatp = fat;
+            return 0;
+        }
+
+        pthread_mutex_unlock(&fat->mutex);
+        p = skinny->val;
+        if ((uintptr_t) p <= 1)
+            break;
+    }
+
+    /* There is no longer a fat_mutex to access, so backtrack. */
+    hazard_clear(0);
+    return -1;
+}
+
+#endif
+
 /* Allocate a fat_mutex and associate it with a skinny_mutex.
  *
  * "skinny" points to the skinny_mutex.
@@ -355,6 +416,7 @@ static int skinny_mutex_promote(skinny_mutex_t *skinny,
     fat->waiters = 0;
     fat->transfer_gen = 0;
     fat->transfers = 0;
+    fat->dead = false;
 
     res = pthread_mutex_init(&fat->mutex, NULL);
     if (res)
@@ -403,9 +465,25 @@ static int fat_mutex_get(skinny_mutex_t *skinny,
     if ((uintptr_t) head <= 1)
         return skinny_mutex_promote(skinny, head, fatp);
     else
-        return fat_mutex_peg(skinny, head, fatp);
+        return fat_mutex_access(skinny, head, fatp);
+}
+
+static int fat_mutex_destroy(struct fat_mutex *fat)
+{
+    int res = pthread_mutex_destroy(&fat->mutex);
+    if (res)
+        return res;
+
+    res = pthread_cond_destroy(&fat->cond);
+    if (res)
+        return res;
+
+    free(fat);
+    return 0;
 }
 
+#ifdef SKINNY_MUTEX_PEGGING
+
 /* Decrement the refcount on a fat_mutex, unlock it, and free it
  * if the conditions are right.
  */
@@ -425,18 +503,43 @@ static int fat_mutex_release(skinny_mutex_t *skinny, struct fat_mutex *fat)
     if (keep || res)
         return res;
 
-    res = pthread_mutex_destroy(&fat->mutex);
-    if (res)
-        return res;
+    return fat_mutex_destroy(fat);
+}
 
-    res = pthread_cond_destroy(&fat->cond);
+#else
+
+static void fat_mutex_free(void *v_fat)
+{
+    int res = fat_mutex_destroy(v_fat);
     if (res)
-        return res;
+        log_err("failed to destroy fat_mutex: %d", res);
+}
 
-    free(fat);
-    return 0;
+/* Decrement the refcount on a fat_mutex, unlock it, and retire it
+ * if nothing else refers to it.
+ */
+static int fat_mutex_release(skinny_mutex_t *skinny, struct fat_mutex *fat)
+{
+    /* If the decremented refcount reaches zero, no thread is relying on
+     * the fat_mutex, and the skinny_mutex can go back to being unheld.
+     * Threads that read the pointer before we cleared it may still be
+     * about to lock the fat_mutex, which is what the hazard pointers and
+     * the dead flag are for.
+     */
+    bool keep = --fat->refcount;
+    if (!keep) {
+        atomic_xchg(&skinny->val, NULL);
+        fat->dead = true;
+    }
+
+    int res = pthread_mutex_unlock(&fat->mutex);
+    if (!keep)
+        hazard_retire(fat, fat_mutex_free);
+    return res;
 }
 
+#endif
+
 /* Try to acquire a skinny_mutex with an associated fat_mutex.
  *
  * The fat_mutex's mutex will be released, so the calling thread
@@ -474,26 +577,33 @@ static int fat_mutex_lock(skinny_mutex_t *skinny, struct fat_mutex *fat)
 /* Called from skinny_mutex_lock when the fast path fails. */
 int skinny_mutex_lock_slow(skinny_mutex_t *skinny)
 {
+    int res;
+
+    TT_WAIT_BEGIN(TT_WAIT_MUTEX);
     for (;;) {
         struct common *head = skinny->val;
         if (head) {
             struct fat_mutex *fat;
-            int res = fat_mutex_get(skinny, head, &fat);
+            res = fat_mutex_get(skinny, head, &fat);
             if (!res) {
                 fat->refcount++;
                 res = fat_mutex_lock(skinny, fat);
             }
 
             if (res >= 0)
-                return res;
+                break;
 
             /* skinny_mutex value changed under us, try again. */
         } else {
             /* Recapitulate skinny_mutex_lock */
-            if (CAS(&skinny->val, head, (void *) 1))
-                return 0;
+            if (CAS(&skinny->val, head, (void *) 1)) {
+                res = 0;
+                break;
+            }
         }
     }
+    TT_WAIT_END();
+    return res;
 }
 
 int skinny_mutex_trylock(skinny_mutex_t *skinny)
@@ -514,7 +624,7 @@ int skinny_mutex_trylock(skinny_mutex_t *skinny)
             return EBUSY;
 
         default:
-            res = fat_mutex_peg(skinny, head, &fat);
+            res = fat_mutex_access(skinny, head, &fat);
             if (res > 0)
                 return res;
             else if (res < 0)
@@ -744,7 +854,7 @@ int skinny_mutex_veto_transfer(skinny_mutex_t *skinny)
             /* Mutex not held */
             return EPERM;
 
-        res = fat_mutex_peg(skinny, head, &fat);
+        res = fat_mutex_access(skinny, head, &fat);
         if (res == 0)
             break;
 
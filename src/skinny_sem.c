@@ -0,0 +1,85 @@
+#include "skinny_sem.h"
+
+#include <limits.h>
+
+#include "futex.h"
+#include "threadtracer.h"
+
+/* The futex word is the count, the low half of the 64-bit word. */
+static inline _Atomic unsigned int *count_word(skinny_sem_t *s)
+{
+    return (_Atomic unsigned int *) &s->val +
+           (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__);
+}
+
+int skinny_sem_wait_slow(skinny_sem_t *s, const struct timespec *abstime)
+{
+    for (int i = spin_limit(); i > 0; --i) {
+        spin_pause();
+        if (!skinny_sem_trywait(s))
+            return 0;
+    }
+
+    TT_WAIT_BEGIN(TT_WAIT_CONDVAR);
+    int res = 0;
+    uint64_t v = atomic_fetch_add(&s->val, SKINNY_SEM_WAITER);
+    v += SKINNY_SEM_WAITER;
+    for (;;) {
+        if ((uint32_t) v) {
+            /* Take one, and stop waiting, at once. */
+            if (atomic_compare_exchange_weak_explicit(
+                    &s->val, &v, v - 1 - SKINNY_SEM_WAITER,
+                    memory_order_acquire, memory_order_relaxed))
+                break;
+            continue;
+        }
+        if (res) {
+            /* Timed out, or abstime is invalid. */
+            v = atomic_fetch_sub(&s->val, SKINNY_SEM_WAITER);
+            v -= SKINNY_SEM_WAITER;
+            /* We might have been woken for a post that we leave behind. */
+            if ((uint32_t) v && v >= SKINNY_SEM_WAITER)
+                skinny_sem_wake(s);
+            break;
+        }
+        res = futex_wait_until(count_word(s), 0, abstime);
+        if (res == EAGAIN || res == EINTR)
+            res = 0;
+        v = atomic_load_explicit(&s->val, memory_order_relaxed);
+    }
+    TT_WAIT_END();
+    return res;
+}
+
+void skinny_sem_wake(skinny_sem_t *s)
+{
+    futex_wake(count_word(s), 1);
+}
+
+int skinny_event_wait_slow(skinny_event_t *e, const struct timespec *abstime)
+{
+    for (int i = spin_limit(); i > 0; --i) {
+        spin_pause();
+        if (skinny_event_is_set(e))
+            return 0;
+    }
+
+    TT_WAIT_BEGIN(TT_WAIT_CONDVAR);
+    int res = 0;
+    unsigned int v = atomic_load_explicit(&e->val, memory_order_acquire);
+    while (v != SKINNY_EVENT_SET && !res) {
+        if (!v && !atomic_compare_exchange_weak(&e->val, &v, 1))
+            continue;
+        res = futex_wait_until(&e->val, 1, abstime);
+        if (res == EAGAIN || res == EINTR)
+            res = 0;
+        v = atomic_load_explicit(&e->val, memory_order_acquire);
+    }
+    TT_WAIT_END();
+    return v == SKINNY_EVENT_SET ? 0 : res;
+}
+
+void skinny_event_wake(skinny_event_t *e)
+{
+    futex_wake(&e->val, INT_MAX);
+}
@@ -1,9 +1,12 @@
 #include "tasklet.h"
 
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "threadtracer.h"
+
 #define pointer_bits(p) ((uintptr_t)(p) &3)
 #define pointer_clear_bits(p) ((void *) ((uintptr_t)(p) & -4))
 #define pointer_set_bits(p, bits) ((void *) ((uintptr_t)(p) | (bits)))
@@ -142,8 +145,22 @@ static void cleanup_default_worker(void)
 
 TLS_VAR_DECLARE_STATIC(tls_run_queue);
 
+/* A cached thread starts the next function without a target. */
+static void reset_run_queue_target(void)
+{
+    TLS_VAR_SET(tls_run_queue, NULL);
+}
+
+static pthread_once_t run_queue_target_once = PTHREAD_ONCE_INIT;
+
+static void run_queue_target_once_func(void)
+{
+    thread_on_reuse(reset_run_queue_target);
+}
+
 void run_queue_target(struct run_queue *runq)
 {
+    pthread_once(&run_queue_target_once, run_queue_target_once_func);
     TLS_VAR_SET(tls_run_queue, runq);
 }
 
@@ -225,14 +242,17 @@ void tasklet_run(struct tasklet *t)
 
             if (__sync_bool_compare_and_swap(&t->runq, NULL, runq)) {
                 run_queue_enqueue(runq, t);
+                TT_FLOW_BEGIN_CAT("tasklet", t, "tasklet");
                 done = true;
             }
         } else {
             mutex_lock(&runq->mutex);
 
             if (t->runq == runq) {
-                if (runq->current == t)
+                if (runq->current == t) {
                     runq->current_state = CURRENT_REQUEUE;
+                    TT_FLOW_BEGIN_CAT("tasklet", t, "tasklet");
+                }
 
                 done = true;
             }
@@ -502,10 +522,12 @@ void run_queue_run(struct run_queue *runq, int wait)
             goto out;
 
         runq->worker_waiting = true;
+        TT_WAIT_BEGIN(TT_WAIT_CONDVAR);
         do {
             cond_wait(&runq->cond, &runq->mutex);
             t = runq->head;
         } while (!t);
+        TT_WAIT_END();
         runq->worker_waiting = false;
     }
 
@@ -530,7 +552,10 @@ void run_queue_run(struct run_queue *runq, int wait)
                 goto next;
         }
 
+        TT_BEGIN_CAT("tasklet", "tasklet");
+        TT_FLOW_END_CAT("tasklet", t, "tasklet");
         t->handler(t->data);
+        TT_END_CAT("tasklet", "tasklet");
 
         mutex_lock(&runq->mutex);
         if (runq->current != t)
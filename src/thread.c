@@ -1,33 +1,235 @@
 #include "thread.h"
 
+#include <inttypes.h>
+#include <limits.h>
+#include <sched.h>
 #include <signal.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
-struct thread_params {
+#include "futex.h"
+
+#ifndef THREAD_CACHE_SIZE
+#define THREAD_CACHE_SIZE 8
+#endif
+
+#define THREAD_MAX_RESETS 8
+
+/* A thread that runs the functions handed to it by thread_init, one at a
+ * time, and parks in between.
+ */
+struct thread_slot {
+    pthread_t handle;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+
+    /* The function to run, or NULL while parked. */
     void (*func)(void *data);
     void *data;
+
+    /* Set when func has returned. */
+    bool done;
+
+    /* Set when the thread should exit rather than wait for a function. */
+    bool exit;
+
+    /* Set if func called pthread_exit, so the thread is gone. */
+    bool exited;
+
+    /* The next slot in the cache. */
+    struct thread_slot *next;
 };
 
-static void *thread_trampoline(void *v_params)
+/* The parked threads */
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct thread_slot *cache;
+static int cache_size;
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
+
+static void (*resets[THREAD_MAX_RESETS])(void);
+static int num_resets;
+
+void thread_on_reuse(void (*reset)(void))
+{
+    pthread_mutex_lock(&cache_mutex);
+    assert(num_resets < THREAD_MAX_RESETS);
+    resets[num_resets++] = reset;
+    pthread_mutex_unlock(&cache_mutex);
+}
+
+static void thread_slot_exited(void *v_slot)
 {
-    struct thread_params params = *(struct thread_params *) v_params;
-    free(v_params);
-    params.func(params.data);
+    struct thread_slot *slot = v_slot;
+
+    pthread_mutex_lock(&slot->mutex);
+    slot->done = true;
+    slot->exited = true;
+    pthread_cond_broadcast(&slot->cond);
+    pthread_mutex_unlock(&slot->mutex);
+}
+
+/* What a function may change about its thread, and thread_slot_main puts
+ * back before the next one: the signal mask, CPU affinity and name.
+ */
+struct thread_state {
+    sigset_t sigmask;
+    cpu_set_t cpus;
+    char name[16];
+    bool has_cpus;
+    bool has_name;
+};
+
+static void thread_state_save(struct thread_state *state)
+{
+    pthread_t self = pthread_self();
+
+    pthread_sigmask(SIG_SETMASK, NULL, &state->sigmask);
+    state->has_cpus =
+        !pthread_getaffinity_np(self, sizeof(state->cpus), &state->cpus);
+    state->has_name =
+        !pthread_getname_np(self, state->name, sizeof(state->name));
+}
+
+static void thread_state_restore(const struct thread_state *state)
+{
+    pthread_t self = pthread_self();
+
+    pthread_sigmask(SIG_SETMASK, &state->sigmask, NULL);
+    if (state->has_cpus)
+        pthread_setaffinity_np(self, sizeof(state->cpus), &state->cpus);
+    if (state->has_name)
+        pthread_setname_np(self, state->name);
+    pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+    pthread_setcanceltype(PTHREAD_CANCEL_DEFERRED, NULL);
+}
+
+static void *thread_slot_main(void *v_slot)
+{
+    struct thread_slot *slot = v_slot;
+    struct thread_state state;
+
+    thread_state_save(&state);
+    pthread_mutex_lock(&slot->mutex);
+    for (;;) {
+        while (!slot->func && !slot->exit)
+            pthread_cond_wait(&slot->cond, &slot->mutex);
+
+        if (!slot->func)
+            break;
+
+        void (*func)(void *data) = slot->func;
+        void *data = slot->data;
+        pthread_mutex_unlock(&slot->mutex);
+
+        pthread_cleanup_push(thread_slot_exited, slot);
+        func(data);
+        pthread_cleanup_pop(0);
+
+        pthread_mutex_lock(&cache_mutex);
+        int n = num_resets;
+        pthread_mutex_unlock(&cache_mutex);
+        for (int i = 0; i < n; i++)
+            resets[i]();
+        thread_state_restore(&state);
+
+        pthread_mutex_lock(&slot->mutex);
+        slot->func = NULL;
+        slot->done = true;
+        pthread_cond_broadcast(&slot->cond);
+    }
+    pthread_mutex_unlock(&slot->mutex);
     return NULL;
 }
 
+static void thread_slot_destroy(struct thread_slot *slot)
+{
+    pthread_mutex_lock(&slot->mutex);
+    slot->exit = true;
+    pthread_cond_signal(&slot->cond);
+    pthread_mutex_unlock(&slot->mutex);
+    pthread_join(slot->handle, NULL);
+    pthread_cond_destroy(&slot->cond);
+    pthread_mutex_destroy(&slot->mutex);
+    free(slot);
+}
+
+/* Let the parked threads exit with the process. */
+static void cleanup_cache(void)
+{
+    pthread_mutex_lock(&cache_mutex);
+    struct thread_slot *slot = cache;
+    cache = NULL;
+    cache_size = 0;
+    pthread_mutex_unlock(&cache_mutex);
+
+    while (slot) {
+        struct thread_slot *next = slot->next;
+        thread_slot_destroy(slot);
+        slot = next;
+    }
+}
+
+static void cache_once_func(void)
+{
+    atexit(cleanup_cache);
+}
+
 void thread_init(struct thread *thr, void (*func)(void *data), void *data)
 {
-    struct thread_params *params = malloc(sizeof *params);
-    params->func = func;
-    params->data = data;
-    pthread_create(&thr->handle, NULL, thread_trampoline, params);
+    pthread_mutex_lock(&cache_mutex);
+    struct thread_slot *slot = cache;
+    if (slot) {
+        cache = slot->next;
+        cache_size--;
+    }
+    pthread_mutex_unlock(&cache_mutex);
+
+    if (slot) {
+        pthread_mutex_lock(&slot->mutex);
+        slot->func = func;
+        slot->data = data;
+        slot->done = false;
+        pthread_cond_signal(&slot->cond);
+        pthread_mutex_unlock(&slot->mutex);
+    } else {
+        slot = malloc(sizeof *slot);
+        pthread_mutex_init(&slot->mutex, NULL);
+        pthread_cond_init(&slot->cond, NULL);
+        slot->func = func;
+        slot->data = data;
+        slot->done = false;
+        slot->exit = false;
+        slot->exited = false;
+        pthread_create(&slot->handle, NULL, thread_slot_main, slot);
+    }
+
+    thr->slot = slot;
+    thr->handle = slot->handle;
     thr->init = malloc(1);
 }
 
 void thread_fini(struct thread *thr)
 {
-    pthread_join(thr->handle, NULL);
+    struct thread_slot *slot = thr->slot;
+
+    pthread_mutex_lock(&slot->mutex);
+    while (!slot->done)
+        pthread_cond_wait(&slot->cond, &slot->mutex);
+    pthread_mutex_unlock(&slot->mutex);
+
+    pthread_once(&cache_once, cache_once_func);
+    pthread_mutex_lock(&cache_mutex);
+    bool cached = !slot->exited && cache_size < THREAD_CACHE_SIZE;
+    if (cached) {
+        slot->next = cache;
+        cache = slot;
+        cache_size++;
+    }
+    pthread_mutex_unlock(&cache_mutex);
+
+    if (!cached)
+        thread_slot_destroy(slot);
     free(thr->init);
 }
 
@@ -36,11 +238,158 @@ void thread_signal(thread_handle_t thr, int sig)
     pthread_kill(thr, sig);
 }
 
-void mutex_init(struct mutex *m)
+#ifdef MUTEX_STATS
+
+/* Bucket b counts times below 2^b ticks. */
+#define MUTEX_STATS_BUCKETS 40
+
+struct mutex_stats {
+    const char *file;
+    int line;
+    _Atomic uint64_t wait[MUTEX_STATS_BUCKETS];
+    _Atomic uint64_t hold[MUTEX_STATS_BUCKETS];
+    struct mutex_stats *next;
+};
+
+static pthread_mutex_t stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct mutex_stats *stats_list;
+
+/* A cheap timestamp.  Its ticks need not be nanoseconds. */
+static inline uint64_t stats_ticks(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#elif defined(__aarch64__)
+    uint64_t t;
+    __asm__ volatile("mrs %0, cntvct_el0" : "=r"(t));
+    return t;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+#endif
+}
+
+static inline void stats_add(_Atomic uint64_t *hist, uint64_t ticks)
+{
+    int b = ticks ? 64 - __builtin_clzll(ticks) : 0;
+    if (b >= MUTEX_STATS_BUCKETS)
+        b = MUTEX_STATS_BUCKETS - 1;
+    atomic_fetch_add_explicit(&hist[b], 1, memory_order_relaxed);
+}
+
+/* Called before acquiring a mutex. */
+static inline uint64_t stats_acquiring(void)
+{
+    return stats_ticks();
+}
+
+/* Called once the mutex has been acquired, after stats_acquiring. */
+static inline void stats_acquired(struct mutex *m, uint64_t start)
+{
+    m->locked_at = stats_ticks();
+    if (m->stats)
+        stats_add(m->stats->wait, m->locked_at - start);
+}
+
+/* Called before releasing the mutex, which might be freed right after. */
+static inline void stats_releasing(struct mutex *m)
+{
+    if (m->stats)
+        stats_add(m->stats->hold, stats_ticks() - m->locked_at);
+}
+
+static struct mutex_stats *stats_for(const char *file, int line)
+{
+    struct mutex_stats *stats;
+
+    pthread_mutex_lock(&stats_mutex);
+    for (stats = stats_list; stats; stats = stats->next)
+        if (stats->line == line && !strcmp(stats->file, file))
+            break;
+    if (!stats) {
+        stats = calloc(1, sizeof(*stats));
+        if (stats) {
+            stats->file = file;
+            stats->line = line;
+            stats->next = stats_list;
+            stats_list = stats;
+        }
+    }
+    pthread_mutex_unlock(&stats_mutex);
+    return stats;
+}
+
+void mutex_init_at(struct mutex *m, const char *file, int line)
+{
+    (mutex_init)(m);
+    m->stats = stats_for(file, line);
+}
+
+static void stats_dump_hist(FILE *out, const char *what,
+                            _Atomic uint64_t *hist)
+{
+    for (int b = 0; b < MUTEX_STATS_BUCKETS; ++b) {
+        uint64_t n = atomic_load_explicit(&hist[b], memory_order_relaxed);
+        if (n)
+            fprintf(out, "    %s < 2^%-2d ticks: %" PRIu64 "\n", what, b, n);
+    }
+}
+
+void mutex_stats_dump(FILE *out)
+{
+    pthread_mutex_lock(&stats_mutex);
+    for (struct mutex_stats *stats = stats_list; stats; stats = stats->next) {
+        uint64_t locks = 0;
+        for (int b = 0; b < MUTEX_STATS_BUCKETS; ++b)
+            locks += atomic_load_explicit(&stats->wait[b],
+                                          memory_order_relaxed);
+        fprintf(out, "%s:%d: %" PRIu64 " locks\n", stats->file, stats->line,
+                locks);
+        stats_dump_hist(out, "wait", stats->wait);
+        stats_dump_hist(out, "hold", stats->hold);
+    }
+    pthread_mutex_unlock(&stats_mutex);
+}
+
+void mutex_stats_reset(void)
+{
+    pthread_mutex_lock(&stats_mutex);
+    for (struct mutex_stats *stats = stats_list; stats; stats = stats->next)
+        for (int b = 0; b < MUTEX_STATS_BUCKETS; ++b) {
+            atomic_store_explicit(&stats->wait[b], 0, memory_order_relaxed);
+            atomic_store_explicit(&stats->hold[b], 0, memory_order_relaxed);
+        }
+    pthread_mutex_unlock(&stats_mutex);
+}
+
+#else
+
+static inline uint64_t stats_acquiring(void)
+{
+    return 0;
+}
+
+static inline void stats_acquired(struct mutex *m UNUSED, uint64_t start UNUSED)
+{
+}
+
+static inline void stats_releasing(struct mutex *m UNUSED)
+{
+}
+
+#endif
+
+/* In parentheses, as with MUTEX_STATS it is also a macro. */
+void (mutex_init)(struct mutex *m)
 {
     skinny_mutex_init(&m->mutex);
     m->init = malloc(1);
     m->held = false;
+#ifdef MUTEX_STATS
+    m->stats = NULL;
+    m->locked_at = 0;
+#endif
 }
 
 void mutex_fini(struct mutex *m)
@@ -52,13 +401,16 @@ void mutex_fini(struct mutex *m)
 
 void mutex_lock(struct mutex *m)
 {
+    uint64_t start = stats_acquiring();
     skinny_mutex_lock(&m->mutex);
+    stats_acquired(m, start);
     m->held = true;
 }
 
 void mutex_unlock(struct mutex *m)
 {
     assert(m->held);
+    stats_releasing(m);
     m->held = false;
     skinny_mutex_unlock(&m->mutex);
 }
@@ -66,9 +418,12 @@ void mutex_unlock(struct mutex *m)
 bool mutex_transfer(struct mutex *a, struct mutex *b)
 {
     assert(a->held);
+    /* If the transfer is vetoed, the hold so far is counted again. */
+    stats_releasing(a);
     a->held = false;
     int res = skinny_mutex_transfer(&a->mutex, &b->mutex);
     if (res != EAGAIN) {
+        stats_acquired(b, stats_acquiring());
         b->held = true;
         return true;
     }
@@ -97,8 +452,11 @@ void cond_fini(struct cond *c)
 void cond_wait(struct cond *c, struct mutex *m)
 {
     mutex_assert_held(m);
+    stats_releasing(m);
     m->held = false;
     skinny_mutex_cond_wait(&c->cond, &m->mutex);
+    /* Waiting for the signal is not waiting for the mutex. */
+    stats_acquired(m, stats_acquiring());
     m->held = true;
 }
 
@@ -111,3 +469,43 @@ void cond_broadcast(struct cond *c)
 {
     pthread_cond_broadcast(&c->cond);
 }
+
+void eventcount_init(struct eventcount *ec)
+{
+    atomic_init(&ec->epoch, 0);
+    atomic_init(&ec->waiters, 0);
+    ec->init = malloc(1);
+}
+
+void eventcount_fini(struct eventcount *ec)
+{
+    assert(!atomic_load(&ec->waiters));
+    free(ec->init);
+}
+
+unsigned int eventcount_prepare_wait(struct eventcount *ec)
+{
+    atomic_fetch_add(&ec->waiters, 1);
+    /* Either the notifier sees us waiting, or we see its condition. */
+    atomic_thread_fence(memory_order_seq_cst);
+    return atomic_load_explicit(&ec->epoch, memory_order_acquire);
+}
+
+void eventcount_commit_wait(struct eventcount *ec, unsigned int key)
+{
+    while (atomic_load_explicit(&ec->epoch, memory_order_acquire) == key)
+        futex_wait(&ec->epoch, key, NULL);
+    atomic_fetch_sub_explicit(&ec->waiters, 1, memory_order_relaxed);
+}
+
+void eventcount_cancel_wait(struct eventcount *ec)
+{
+    atomic_fetch_sub_explicit(&ec->waiters, 1, memory_order_relaxed);
+}
+
+void eventcount_wake(struct eventcount *ec, bool all)
+{
+    /* Waiters that have yet to sleep see the new epoch and don't. */
+    atomic_fetch_add_explicit(&ec->epoch, 1, memory_order_release);
+    futex_wake(&ec->epoch, all ? INT_MAX : 1);
+}
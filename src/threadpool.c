@@ -4,6 +4,8 @@
 #include <stdint.h>
 
 #include "logger.h"
+#include "percpu.h"
+#include "threadtracer.h"
 
 typedef struct task_s {
     void (*func)(void *);
@@ -20,6 +22,10 @@ struct threadpool_internal {
     int queue_size;
     int shutdown;
     int started;
+
+    /* Updated by every thread, so per-CPU. */
+    percpu_counter_t added;
+    percpu_counter_t completed;
 };
 
 typedef enum { immediate_shutdown = 1, graceful_shutdown = 2 } threadpool_sd_t;
@@ -32,7 +38,10 @@ static int threadpool_free(threadpool_t *pool)
     if (pool->threads)
         free(pool->threads);
 
-    while (pool->head->next) {
+    percpu_counter_destroy(&pool->added);
+    percpu_counter_destroy(&pool->completed);
+
+    while (pool->head && pool->head->next) {
         task_t *old = pool->head->next;
         pool->head->next = pool->head->next->next;
         free(old);
@@ -54,9 +63,11 @@ static void *worker(void *arg)
         pthread_mutex_lock(&(pool->lock));
 
         /*  Wait on condition variable, check for spurious wakeups. */
+        TT_WAIT_BEGIN(TT_WAIT_CONDVAR);
         while ((pool->queue_size == 0) && !(pool->shutdown)) {
             pthread_cond_wait(&(pool->cond), &(pool->lock));
         }
+        TT_WAIT_END();
 
         if ((pool->shutdown == immediate_shutdown) ||
             ((pool->shutdown == graceful_shutdown) && pool->queue_size == 0))
@@ -70,12 +81,19 @@ static void *worker(void *arg)
 
         pool->head->next = task->next;
         pool->queue_size--;
+        TT_COUNTER_CAT("threadpool", "threadpool_queue_size",
+                       pool->queue_size);
 
         pthread_mutex_unlock(&(pool->lock));
 
+        TT_BEGIN_CAT("threadpool", "threadpool_task");
+        TT_FLOW_END_CAT("threadpool", task, "threadpool_task");
         (*(task->func))(task->arg);
+        TT_END_CAT("threadpool", "threadpool_task");
+        TT_ASYNC_END_CAT("threadpool", task, "threadpool_task");
         /* TODO: memory pool */
         free(task);
+        percpu_counter_add(&pool->completed, 1);
     }
 
     pool->started--;
@@ -99,6 +117,9 @@ threadpool_t *threadpool_init(int thread_num)
     pool->queue_size = 0;
     pool->shutdown = 0;
     pool->started = 0;
+    /* Unset until initialized below, for threadpool_free on failure. */
+    pool->added.slots = NULL;
+    pool->completed.slots = NULL;
     pool->threads = (pthread_t *) malloc(sizeof(pthread_t) * thread_num);
     pool->head = (task_t *) malloc(sizeof(task_t)); /* dummy head */
 
@@ -109,6 +130,11 @@ threadpool_t *threadpool_init(int thread_num)
     pool->head->arg = NULL;
     pool->head->next = NULL;
 
+    bool counters_ok = !percpu_counter_init(&pool->added);
+    counters_ok &= !percpu_counter_init(&pool->completed);
+    if (!counters_ok)
+        goto err;
+
     if (pthread_mutex_init(&(pool->lock), NULL))
         goto err;
 
@@ -165,6 +191,11 @@ int threadpool_add(threadpool_t *pool, void (*func)(void *), void *arg)
     pool->head->next = task;
 
     pool->queue_size++;
+    percpu_counter_add(&pool->added, 1);
+    TT_COUNTER_CAT("threadpool", "threadpool_queue_size", pool->queue_size);
+
+    TT_ASYNC_BEGIN_CAT("threadpool", task, "threadpool_task");
+    TT_FLOW_BEGIN_CAT("threadpool", task, "threadpool_task");
 
     rc = pthread_cond_signal(&(pool->cond));
     check(rc == 0, "pthread_cond_signal");
@@ -222,3 +253,13 @@ int threadpool_destroy(threadpool_t *pool, bool graceful)
 
     return err;
 }
+
+int threadpool_stats(threadpool_t *pool, threadpool_stats_t *stats)
+{
+    if (!pool || !stats)
+        return tp_invalid;
+
+    stats->added = percpu_counter_read(&pool->added);
+    stats->completed = percpu_counter_read(&pool->completed);
+    return 0;
+}
@@ -1,22 +1,51 @@
 #include "threadtracer.h"
+#include "cacheline.h"
+#include "threadtracer_file.h"
 
+#include <errno.h>
+#include <fcntl.h>
 #include <inttypes.h>
 #include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/resource.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <time.h>
 #include <unistd.h>
 
+#include <sys/mman.h>
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#endif
+
 #define MAXTHREADS 12         //!< How many threads can we support?
 #define MAXSAMPLES 64 * 1024  //!< How many samples can we record for a thread?
+#define MAXDEPTH 64           //!< How deeply can scopes be nested?
+#define MAXTAGS 256           //!< How many tags can we sample per thread?
+#define MAXRULES 32           //!< How many category and sampling rules?
+#define HISTBUCKETS 496       //!< How many buckets in a duration histogram?
+#define NUMPERF TRACEFILE_NUMPERF  //!< How many hardware counters per sample?
+#define HUGEPAGE (2 << 20)    //!< Size of huge pages for the buffers.
+#define MAXSTRINGS 4096       //!< How many strings in a trace file?
 
-//! How many threads are we currently tracing?
+//! How many thread slots have been claimed?
 static _Atomic int numthreads = 0;
 
-//! When (in wallclock time) did we start tracing?
+//! The time base is set up once, by the first thread that signs in.  Every
+//! thread that records samples has signed in, so pthread_once() publishes
+//! walloffset and wallcutoff to all of them.
+static pthread_once_t timebase_once = PTHREAD_ONCE_INIT;
+
+//! When (in wallclock time) did we start tracing?  Timestamps are relative
+//! to this, unless the THREADTRACERABSOLUTE env var is set, in which case it
+//! is 0, and timestamps of all processes on a host share the same base.
+//! Reports record it, so that tools/threadtracer-merge can line them up.
 static int64_t walloffset = 0;
 
 //! Optionally, we can delay the recording until this timestamp using
@@ -24,24 +53,104 @@ static int64_t walloffset = 0;
 static int64_t wallcutoff = 0;
 
 //! Are we currently recording events?
-static int isrecording = 0;
+static _Atomic int isrecording = 0;
 
-//! The information we record for a trace event.
-typedef struct {
-    const char *cat;                //!< category
-    const char *tag;                //!< tag
-    const char *phase;              //!< "B" or "E"
-    int64_t wall_time;              //!< timestamp on wall clock
-    int64_t cpu_time;               //!< timestamp on thread's cpu clock
-    int64_t num_preemptive_switch,  //!< number of context switches (premptive)
-        num_voluntary_switch;  //!< number of context switches (cooperative)
-} sample_t;
+//! The categories named in the THREADTRACERCATEGORIES env var.  A name
+//! prefixed with '-' disables that category.  If any category is named
+//! without a prefix, only the named categories are recorded.
+static struct {
+    const char *name;
+    int enabled;
+} catrules[MAXRULES];
+static int numcatrules = 0;
+static int catdefault = 1;
+
+//! Record 1 in N events per tag, from the THREADTRACERSAMPLE env var, which
+//! holds a default N and/or "tag=N" overrides, separated by commas.
+static struct {
+    const char *tag;
+    int every;
+} samplerules[MAXRULES];
+static int numsamplerules = 0;
+static int sampleevery = 1;
+
+//! Discard begin/end pairs shorter than this, from the
+//! THREADTRACERMINDURATION env var (in microseconds).
+static int64_t minduration = 0;
+
+//! Instead of recording events, aggregate statistics per tag, if the
+//! THREADTRACERAGGREGATE env var is set.
+static int aggregating = 0;
+
+//! Write Perfetto protobuf traces instead of JSON by default, if the
+//! THREADTRACERFORMAT env var is "perfetto".
+static int perfetto = 0;
+
+//! Read hardware counters at the begin and end of scopes, if the
+//! THREADTRACERPERF env var is set.
+static int perfcounting = 0;
+
+//! Record the samples in files in this directory, from the THREADTRACERMMAP
+//! env var, so that they survive a crash.
+static const char *tracefiledir = NULL;
+
+//! Back the buffers with huge pages, if the THREADTRACERHUGEPAGES env var is
+//! set.
+static int hugepages = 0;
+
+//! Break down the off-CPU time of scopes whose duty cycle is below this
+//! percentage by wait reason, from the THREADTRACEROFFCPU env var.
+static int offcputhreshold = 0;
 
 //! The samples recorded, per thread.
-static sample_t samples[MAXTHREADS][MAXSAMPLES];
+static sample_t *samples[MAXTHREADS];
 
-//! The number of samples recorded, per thread.
-static int samplecounts[MAXTHREADS];
+//! Set once a slot has been filled in by the thread that claimed it.
+static _Atomic int slotready[MAXTHREADS];
+
+//! A scope that is currently open.
+typedef struct {
+    const char *tag;  //!< tag of the "B" event
+    int begin;        //!< index of the "B" sample, or SCOPE_SKIPPED
+    // When aggregating, the "B" event is kept here instead of in a sample.
+    int64_t wall_time, cpu_time;
+    int64_t num_preemptive_switch, num_voluntary_switch;
+} scope_t;
+
+#define SCOPE_UNMATCHED -1  //!< an "E" without an open scope
+#define SCOPE_SKIPPED -2    //!< a scope whose "B" was not sampled
+
+//! The statistics aggregated for a tag.  Wall durations go into a histogram
+//! with 8 sub-buckets per power of two, so percentiles are within 12.5%.
+typedef struct {
+    int64_t count;
+    int64_t wall_total, cpu_total;
+    int64_t wall_min, wall_max;
+    int64_t preempted, voluntary;
+    int64_t hist[HISTBUCKETS];
+} tagstats_t;
+
+//! The scopes that are currently open, per thread.
+static scope_t *scopestacks[MAXTHREADS];
+
+//! The sampling state of a tag.
+typedef struct {
+    const char *tag;  //!< the tag, or NULL if the entry is unused
+    int every;        //!< record 1 in 'every' events
+    int count;        //!< events seen so far
+    tagstats_t *stats;  //!< aggregated statistics, if aggregating
+} tagstate_t;
+
+//! The per-tag state, per thread.  Only used if sampling or aggregating.
+static tagstate_t *tagtables[MAXTHREADS];
+
+//! The files that hold the samples, per thread, if any, and their names.
+static tracefile_t *tracefiles[MAXTHREADS];
+static char *tracefilenames[MAXTHREADS];
+
+//! The strings that are in the string table of the file, per thread, as an
+//! open addressing hash set of pointers.
+static const char **tracefilestrings[MAXTHREADS];
 
 //! The names for the threads.
 static const char *threadnames[MAXTHREADS];
@@ -49,44 +158,647 @@ static const char *threadnames[MAXTHREADS];
 //! The thread-ids.
 static pthread_t threadids[MAXTHREADS];
 
-static __thread int tidx;
+//! The kernel thread-ids, as Perfetto wants those.
+static pid_t threadtids[MAXTHREADS];
 
-//! Before tracing, a thread should make itself known to ThreadTracer.
-int tt_signin(const char *threadname)
+//! The hardware counters of a thread.
+typedef struct {
+    int fds[NUMPERF];  //!< perf events, led by fds[0], or fds[0] is -1
+    //! the pages to read the counters with rdpmc, or NULL
+    struct perf_event_mmap_page *pages[NUMPERF];
+} perfcounters_t;
+
+//! The hardware counters, per thread.
+static perfcounters_t perfcounters[MAXTHREADS];
+
+//! The counters a thread updates as it records, on a cache line of its own.
+typedef struct {
+    //! The number of samples recorded.  Only the owning thread updates it,
+    //! with release semantics, so that a reader that loads it with acquire
+    //! semantics sees complete samples.
+    _Atomic int samplecount;
+    int scopedepth;     //!< number of open scopes
+    int scopeoverflow;  //!< number of open scopes that did not fit
+    //! the time spent waiting so far, per reason
+    int64_t waittotals[TT_WAIT_REASONS];
+} __attribute__((aligned(CACHELINE))) threadcounts_t;
+
+//! The counters, per thread.
+static threadcounts_t threadcounts[MAXTHREADS];
+
+//! The wait that the calling thread is in, if waitdepth is non-zero.
+static __thread int waitdepth;
+static __thread enum tt_wait_reason waitreason;
+static __thread int64_t waitstart;
+
+//! The wait totals at each "B" and "E" sample, per thread, if breaking down
+//! off-CPU time.
+static int64_t (*waitsamples[MAXTHREADS])[TT_WAIT_REASONS];
+
+//! The names of the wait reasons, in the report.
+static const char *const waitnames[TT_WAIT_REASONS] = {TRACEFILE_WAITNAMES};
+_Static_assert(TT_WAIT_REASONS == TRACEFILE_WAITREASONS,
+               "trace files hold a wait total per reason");
+
+//! The names of the hardware counters, in the report.
+static const char *const perfnames[NUMPERF] = {TRACEFILE_PERFNAMES};
+
+//! The hardware counters at each "B" and "E" sample, per thread, if counting.
+static int64_t (*perfsamples[MAXTHREADS])[NUMPERF];
+
+//! The slot of the calling thread, or -1 if it did not sign in, or
+//! SIGNIN_FAILED if it could not get its buffers.
+static __thread int tidx = -1;
+#define SIGNIN_FAILED -2
+
+//! Split a copy of the env var 'name' into comma separated words.
+//! The words are never freed, as rules keep pointing into them.
+static int env_words(const char *name, char **words, int maxwords)
 {
-    int slot = numthreads++;
-    if (slot == 0) {
-        struct timespec wt, ct;
-        clock_gettime(CLOCK_MONOTONIC, &wt);
-        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ct);
-        walloffset = wt.tv_sec * 1000000000L + wt.tv_nsec;
-        struct timespec res;
-        clock_getres(CLOCK_THREAD_CPUTIME_ID, &res);
-        fprintf(stderr, "ThreadTracer: clock resolution: %ld nsec.\n",
-                res.tv_nsec);
-        wallcutoff = walloffset;
-        const char *d = getenv("THREADTRACERSKIP");
-        if (d) {
-            int delayinseconds = atoi(d);
-            wallcutoff += delayinseconds * 1000000000L;
-            fprintf(stderr,
-                    "ThreadTracer: skipping the first %d seconds before "
-                    "recording.\n",
-                    delayinseconds);
+    const char *v = getenv(name);
+    if (!v)
+        return 0;
+    char *copy = strdup(v);
+    char *saveptr = NULL;
+    int n = 0;
+    for (char *w = strtok_r(copy, ",", &saveptr); w && n < maxwords;
+         w = strtok_r(NULL, ",", &saveptr))
+        words[n++] = w;
+    return n;
+}
+
+static void filters_init(void)
+{
+    char *words[MAXRULES];
+    const char *d;
+    int n = env_words("THREADTRACERCATEGORIES", words, MAXRULES);
+    for (int i = 0; i < n; ++i) {
+        int enabled = words[i][0] != '-';
+        catrules[numcatrules].name = words[i] + !enabled;
+        catrules[numcatrules].enabled = enabled;
+        numcatrules++;
+        if (enabled)
+            catdefault = 0;
+        fprintf(stderr, "ThreadTracer: %s category '%s'.\n",
+                enabled ? "recording" : "not recording", words[i] + !enabled);
+    }
+
+    n = env_words("THREADTRACERSAMPLE", words, MAXRULES);
+    for (int i = 0; i < n; ++i) {
+        char *eq = strchr(words[i], '=');
+        if (!eq) {
+            sampleevery = atoi(words[i]) > 1 ? atoi(words[i]) : 1;
+            fprintf(stderr, "ThreadTracer: recording 1 in %d events.\n",
+                    sampleevery);
+            continue;
         }
-        isrecording = 1;
+        *eq = '\0';
+        samplerules[numsamplerules].tag = words[i];
+        samplerules[numsamplerules].every = atoi(eq + 1) > 1 ? atoi(eq + 1) : 1;
+        fprintf(stderr, "ThreadTracer: recording 1 in %d '%s' events.\n",
+                samplerules[numsamplerules].every, words[i]);
+        numsamplerules++;
+    }
+
+    if (getenv("THREADTRACERAGGREGATE")) {
+        aggregating = 1;
+        fprintf(stderr, "ThreadTracer: aggregating statistics per tag.\n");
+    }
+
+    if (getenv("THREADTRACERPERF")) {
+        perfcounting = 1;
+        fprintf(stderr, "ThreadTracer: reading hardware counters.\n");
+    }
+
+    if (getenv("THREADTRACERHUGEPAGES")) {
+        hugepages = 1;
+        fprintf(stderr, "ThreadTracer: using huge pages for the buffers.\n");
+    }
+
+    tracefiledir = getenv("THREADTRACERMMAP");
+    if (tracefiledir)
+        fprintf(stderr, "ThreadTracer: recording samples in files in '%s'.\n",
+                tracefiledir);
+
+    d = getenv("THREADTRACEROFFCPU");
+    if (d) {
+        offcputhreshold = atoi(d) > 0 ? atoi(d) : 100;
+        fprintf(stderr,
+                "ThreadTracer: breaking down off-CPU time of scopes below "
+                "%d%% duty cycle.\n",
+                offcputhreshold);
+    }
+
+    d = getenv("THREADTRACERFORMAT");
+    if (d && !strcmp(d, "perfetto")) {
+        perfetto = 1;
+        fprintf(stderr, "ThreadTracer: writing Perfetto traces.\n");
+    }
+
+    d = getenv("THREADTRACERMINDURATION");
+    if (d) {
+        minduration = atoll(d) * 1000;
+        fprintf(stderr,
+                "ThreadTracer: discarding scopes shorter than %lld usec.\n",
+                (long long) (minduration / 1000));
+    }
+}
+
+static void dumper_init(void);
+
+static void timebase_init(void)
+{
+    struct timespec wt;
+    clock_gettime(CLOCK_MONOTONIC, &wt);
+    walloffset = wt.tv_sec * 1000000000L + wt.tv_nsec;
+    struct timespec res;
+    clock_getres(CLOCK_THREAD_CPUTIME_ID, &res);
+    fprintf(stderr, "ThreadTracer: clock resolution: %ld nsec.\n", res.tv_nsec);
+    wallcutoff = walloffset;
+    const char *d = getenv("THREADTRACERSKIP");
+    if (d) {
+        int delayinseconds = atoi(d);
+        wallcutoff += delayinseconds * 1000000000L;
+        fprintf(stderr,
+                "ThreadTracer: skipping the first %d seconds before "
+                "recording.\n",
+                delayinseconds);
+    }
+    filters_init();
+    if (getenv("THREADTRACERABSOLUTE")) {
+        walloffset = 0;
+        fprintf(stderr, "ThreadTracer: using absolute timestamps.\n");
+    }
+    atomic_store(&isrecording, 1);
+    dumper_init();
+}
+
+#if defined(__linux__)
+static int perf_event_open(struct perf_event_attr *attr, int group_fd)
+{
+    return (int) syscall(SYS_perf_event_open, attr, 0, -1, group_fd,
+                         PERF_FLAG_FD_CLOEXEC);
+}
+#endif
+
+//! Open the hardware counters of the calling thread, in slot 'slot'.  They
+//! count in user space only, so that they work with the default
+//! perf_event_paranoid setting.  If any of them cannot be opened, the thread
+//! is traced without them.
+static void perf_open(int slot)
+{
+    perfcounters_t *pc = perfcounters + slot;
+    for (int i = 0; i < NUMPERF; ++i) {
+        pc->fds[i] = -1;
+        pc->pages[i] = NULL;
+    }
+#if defined(__linux__)
+    static const uint64_t configs[NUMPERF] = {
+        PERF_COUNT_HW_CPU_CYCLES,
+        PERF_COUNT_HW_INSTRUCTIONS,
+        PERF_COUNT_HW_CACHE_MISSES,
+    };
+    static _Atomic int warned = 0;
+    for (int i = 0; i < NUMPERF; ++i) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = configs[i];
+        attr.read_format = PERF_FORMAT_GROUP;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        pc->fds[i] = perf_event_open(&attr, i ? pc->fds[0] : -1);
+        if (pc->fds[i] < 0) {
+            if (!atomic_exchange(&warned, 1))
+                fprintf(stderr,
+                        "ThreadTracer: hardware counters unavailable: %s.\n",
+                        strerror(errno));
+            for (int j = 0; j < i; ++j)
+                close(pc->fds[j]);
+            pc->fds[0] = -1;
+            return;
+        }
+    }
+#if defined(__x86_64__) || defined(__i386__)
+    // Map the pages that tell where to find the counters for rdpmc.
+    const long pagesize = sysconf(_SC_PAGESIZE);
+    for (int i = 0; i < NUMPERF; ++i) {
+        void *p = mmap(NULL, pagesize, PROT_READ, MAP_SHARED, pc->fds[i], 0);
+        if (p == MAP_FAILED)
+            break;
+        pc->pages[i] = p;
+        if (!pc->pages[i]->cap_user_rdpmc)
+            break;
+    }
+#endif
+#endif
+}
+
+#if defined(__linux__) && (defined(__x86_64__) || defined(__i386__))
+//! Read a counter with rdpmc, as documented in linux/perf_event.h.
+//! Returns -1 if the counter is not currently on the PMU.
+static int perf_read_page(const struct perf_event_mmap_page *page,
+                          int64_t *value)
+{
+    const volatile uint32_t *lock = &page->lock;
+    uint32_t seq;
+    int64_t count;
+    do {
+        seq = *lock;
+        atomic_signal_fence(memory_order_seq_cst);
+        const uint32_t idx = page->index;
+        if (!page->cap_user_rdpmc || !idx)
+            return -1;
+        count = page->offset;
+        uint32_t lo, hi;
+        __asm__ volatile("rdpmc" : "=a"(lo), "=d"(hi) : "c"(idx - 1));
+        const int shift = 64 - page->pmc_width;
+        count += (int64_t) (((uint64_t) hi << 32 | lo) << shift) >> shift;
+        atomic_signal_fence(memory_order_seq_cst);
+    } while (*lock != seq);
+    *value = count;
+    return 0;
+}
+#endif
+
+//! Read the hardware counters of the calling thread.  The rdpmc instruction
+//! avoids a system call, but needs all counters to be on the PMU; otherwise
+//! the group is read in one read() call.
+static void perf_read(int64_t *values)
+{
+    const perfcounters_t *pc = perfcounters + tidx;
+#if defined(__linux__) && (defined(__x86_64__) || defined(__i386__))
+    int i = 0;
+    while (i < NUMPERF && pc->pages[i] &&
+           perf_read_page(pc->pages[i], values + i) == 0)
+        i++;
+    if (i == NUMPERF)
+        return;
+#endif
+    uint64_t buf[1 + NUMPERF];  // PERF_FORMAT_GROUP: nr, then the values
+    if (read(pc->fds[0], buf, sizeof(buf)) == sizeof(buf)) {
+        for (int i = 0; i < NUMPERF; ++i)
+            values[i] = (int64_t) buf[1 + i];
+    } else {
+        for (int i = 0; i < NUMPERF; ++i)
+            values[i] = -1;
+    }
+}
+
+//! Map memory for the buffers of a thread, in huge pages if the
+//! THREADTRACERHUGEPAGES env var is set and the system has some to spare, or
+//! else hinting that transparent huge pages would do.
+static void *buffers_map(size_t size)
+{
+    void *p = MAP_FAILED;
+    if (hugepages) {
+        size = (size + HUGEPAGE - 1) & ~(size_t) (HUGEPAGE - 1);
+#if defined(MAP_HUGETLB)
+        p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+    }
+    if (p == MAP_FAILED) {
+        p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED)
+            return NULL;
+#if defined(MADV_HUGEPAGE)
+        if (hugepages)
+            madvise(p, size, MADV_HUGEPAGE);
+#endif
+    }
+    return p;
+}
+
+//! Carve 'size' bytes for one of the buffers out of 'base', at '*offset'.
+static void *buffers_carve(char *base, size_t *offset, size_t size)
+{
+    void *p = base + *offset;
+    *offset += (size + CACHELINE - 1) & ~(size_t) (CACHELINE - 1);
+    return p;
+}
+
+//! Create the file that holds the samples of slot 'slot', and map it, so
+//! that the samples are in the page cache as soon as they are recorded, and
+//! outlive the process.  No system calls are needed to record them.
+//! If the file cannot be created, the samples are kept in memory.
+static void tracefile_open(int slot)
+{
+    char name[4096];
+    const size_t size = TRACEFILE_SIZE(MAXSAMPLES);
+    snprintf(name, sizeof(name), "%s/threadtracer.%ld.%d.trace", tracefiledir,
+             (long) getpid(), slot);
+    int fd = open(name, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    void *p = MAP_FAILED;
+    if (fd >= 0) {
+        if (ftruncate(fd, size) == 0)
+            p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+    }
+    if (p == MAP_FAILED) {
+        fprintf(stderr, "ThreadTracer: Cannot map %s: %s.\n", name,
+                strerror(errno));
+        if (fd >= 0)
+            unlink(name);
+        return;
     }
-    if (slot >= MAXTHREADS) {
-        numthreads = MAXTHREADS;
+    tracefile_t *f = p;
+    memcpy(f->magic, TRACEFILE_MAGIC, sizeof(f->magic));
+    f->samplesize = sizeof(sample_t);
+    f->maxsamples = MAXSAMPLES;
+    f->pid = getpid();
+    f->walloffset = walloffset;
+    f->threadid = (uint64_t) threadids[slot];
+    strncpy(f->threadname, threadnames[slot] ? threadnames[slot] : "",
+            sizeof(f->threadname) - 1);
+    f->offcputhreshold = offcputhreshold;
+    tracefiles[slot] = f;
+    tracefilenames[slot] = strdup(name);
+    samples[slot] = TRACEFILE_SAMPLES(f);
+    waitsamples[slot] = TRACEFILE_WAITS(f, MAXSAMPLES);
+    perfsamples[slot] = TRACEFILE_PERF(f, MAXSAMPLES);
+}
+
+//! Add 's' to the string table in the file of the calling thread, unless it
+//! is there already.  Strings that do not fit show up as "?" when recovered.
+static void tracefile_string(const char *s)
+{
+    const char **set = tracefilestrings[tidx];
+    const uint32_t h = ((uintptr_t) s * 0x9e3779b97f4a7c15ull) >> 32;
+    for (int i = 0; i < MAXSTRINGS; ++i) {
+        const char **entry = set + (h + i) % MAXSTRINGS;
+        if (*entry == s)
+            return;
+        if (*entry)
+            continue;
+
+        tracefile_t *f = tracefiles[tidx];
+        const uint32_t used =
+            atomic_load_explicit(&f->stringbytes, memory_order_relaxed);
+        const size_t len = strlen(s);
+        const size_t n = (sizeof(tracestring_t) + len + 1 + 7) & ~(size_t) 7;
+        if (used + n > TRACEFILE_STRINGBYTES)
+            return;
+        tracestring_t *str =
+            (tracestring_t *) (TRACEFILE_STRINGS(f, MAXSAMPLES) + used);
+        str->key = (uintptr_t) s;
+        str->len = len;
+        memcpy(str->str, s, len + 1);
+        atomic_store_explicit(&f->stringbytes, used + n, memory_order_release);
+        *entry = s;
+        return;
+    }
+}
+
+//! Allocate the buffers of slot 'slot' for the calling thread.  Each thread
+//! has a mapping of its own, so no two threads share a page, and as only the
+//! owning thread writes to it, its pages are first touched, and thus placed
+//! on the NUMA node of, that thread.  The samples are left out when
+//! aggregating, and the per-sample counters unless used.
+static int buffers_alloc(int slot)
+{
+    const size_t scopesize = MAXDEPTH * sizeof(scope_t);
+    const size_t tagsize = MAXTAGS * sizeof(tagstate_t);
+    const size_t samplesize =
+        aggregating || samples[slot] ? 0 : MAXSAMPLES * sizeof(sample_t);
+    const size_t stringsize =
+        tracefiles[slot] ? MAXSTRINGS * sizeof(const char *) : 0;
+    const size_t waitsize =
+        offcputhreshold && !aggregating && !waitsamples[slot]
+            ? MAXSAMPLES * sizeof(*waitsamples[0])
+            : 0;
+    const size_t perfsize =
+        perfcounting && !aggregating && !perfsamples[slot]
+            ? MAXSAMPLES * sizeof(*perfsamples[0])
+            : 0;
+    size_t offset = 0;
+    char *base = buffers_map(scopesize + tagsize + samplesize + stringsize +
+                             waitsize + perfsize + 5 * CACHELINE);
+    if (!base) {
+        fprintf(stderr, "ThreadTracer: Cannot allocate buffers for %s.\n",
+                threadnames[slot]);
         return -1;
     }
+    scopestacks[slot] = buffers_carve(base, &offset, scopesize);
+    tagtables[slot] = buffers_carve(base, &offset, tagsize);
+    if (!samples[slot])
+        samples[slot] = buffers_carve(base, &offset, samplesize);
+    tracefilestrings[slot] = buffers_carve(base, &offset, stringsize);
+    if (!waitsamples[slot])
+        waitsamples[slot] = buffers_carve(base, &offset, waitsize);
+    if (!perfsamples[slot])
+        perfsamples[slot] = buffers_carve(base, &offset, perfsize);
+    return 0;
+}
+
+//! Before tracing, a thread should make itself known to ThreadTracer.
+//! Signing in again from the same thread returns the slot it already has, or
+//! -1 again if it failed.
+int tt_signin(const char *threadname)
+{
+    if (tidx >= 0)
+        return tidx;
+    // The slot of a failed signin stays taken, so don't take another.
+    if (tidx == SIGNIN_FAILED)
+        return -1;
+
+    pthread_once(&timebase_once, timebase_init);
+
+    int slot = atomic_load_explicit(&numthreads, memory_order_relaxed);
+    do {
+        if (slot >= MAXTHREADS)
+            return -1;
+    } while (!atomic_compare_exchange_weak(&numthreads, &slot, slot + 1));
+
     threadnames[slot] = threadname;
     threadids[slot] = pthread_self();
-    samplecounts[slot] = 0;
+    threadtids[slot] = (pid_t) syscall(SYS_gettid);
+    if (tracefiledir && !aggregating)
+        tracefile_open(slot);
+    if (buffers_alloc(slot) < 0) {
+        tidx = SIGNIN_FAILED;
+        return -1;
+    }
+    threadcounts[slot].scopedepth = 0;
+    threadcounts[slot].scopeoverflow = 0;
+    memset(threadcounts[slot].waittotals, 0,
+           sizeof(threadcounts[slot].waittotals));
+    perfcounters[slot].fds[0] = -1;
+    if (perfcounting)
+        perf_open(slot);
+    if (tracefiles[slot])
+        tracefiles[slot]->perfcounting = perfcounters[slot].fds[0] >= 0;
+    atomic_store_explicit(&threadcounts[slot].samplecount, 0,
+                          memory_order_relaxed);
+    atomic_store_explicit(&slotready[slot], 1, memory_order_release);
     tidx = slot;
     return slot;
 }
 
+//! Find the open scope that an "E" sample closes, and pop it (and any
+//! unclosed scopes nested inside it) off the scope stack.
+//! Returns the scope, which stays valid until the next push, or NULL if
+//! there is none.
+static const scope_t *scope_pop(const char *tag)
+{
+    if (threadcounts[tidx].scopeoverflow) {
+        threadcounts[tidx].scopeoverflow--;
+        return NULL;
+    }
+    const scope_t *stack = scopestacks[tidx];
+    for (int d = threadcounts[tidx].scopedepth - 1; d >= 0; --d) {
+        if (stack[d].tag == tag || !strcmp(stack[d].tag, tag)) {
+            threadcounts[tidx].scopedepth = d;
+            return stack + d;
+        }
+    }
+    return NULL;
+}
+
+//! Push a scope, whose "B" sample is at index 'begin', onto the scope stack.
+//! Returns the scope, or NULL if the stack is full.
+static scope_t *scope_push(const char *tag, int begin)
+{
+    if (threadcounts[tidx].scopedepth >= MAXDEPTH) {
+        threadcounts[tidx].scopeoverflow++;
+        return NULL;
+    }
+    scope_t *scope = scopestacks[tidx] + threadcounts[tidx].scopedepth++;
+    scope->tag = tag;
+    scope->begin = begin;
+    return scope;
+}
+
+//! The per-thread cache of the last category looked up, as most events of a
+//! thread share their category.
+static __thread const char *lastcat;
+static __thread int lastcatenabled;
+
+static int category_enabled(const char *cat)
+{
+    if (!numcatrules)
+        return 1;
+    if (cat == lastcat)
+        return lastcatenabled;
+    int enabled = catdefault;
+    for (int i = 0; i < numcatrules; ++i)
+        if (!strcmp(catrules[i].name, cat))
+            enabled = catrules[i].enabled;
+    lastcat = cat;
+    lastcatenabled = enabled;
+    return enabled;
+}
+
+//! Find the state of 'tag' for the calling thread, adding it if needed.
+//! Returns NULL if the table is full.
+static tagstate_t *tag_lookup(const char *tag)
+{
+    tagstate_t *table = tagtables[tidx];
+    const unsigned h =
+        (unsigned) (((uintptr_t) tag * 0x9e3779b97f4a7c15ull) >> 32);
+    for (int i = 0; i < MAXTAGS; ++i) {
+        tagstate_t *ts = table + ((h + i) & (MAXTAGS - 1));
+        if (!ts->tag) {
+            ts->every = sampleevery;
+            for (int r = 0; r < numsamplerules; ++r)
+                if (!strcmp(samplerules[r].tag, tag))
+                    ts->every = samplerules[r].every;
+            ts->count = 0;
+            ts->stats = NULL;
+            // Publish the entry to snapshots once it is filled in.
+            __atomic_store_n(&ts->tag, tag, __ATOMIC_RELEASE);
+        }
+        if (ts->tag == tag)
+            return ts;
+    }
+    return NULL;
+}
+
+//! Decide whether to record this event of 'tag', when sampling 1 in N.
+static int tag_sampled(const char *tag)
+{
+    if (sampleevery == 1 && !numsamplerules)
+        return 1;
+
+    tagstate_t *ts = tag_lookup(tag);
+    // If the table is full, don't sample the remaining tags.
+    return !ts || ts->count++ % ts->every == 0;
+}
+
+//! The histogram bucket for a duration: values below 8 have a bucket each,
+//! larger ones 8 buckets per power of two.
+static int hist_bucket(int64_t v)
+{
+    if (v < 8)
+        return v < 0 ? 0 : (int) v;
+    const int e = 63 - __builtin_clzll((uint64_t) v);
+    return (e - 2) * 8 + (int) ((v >> (e - 3)) & 7);
+}
+
+//! The duration in the middle of a histogram bucket.
+static int64_t hist_value(int b)
+{
+    if (b < 8)
+        return b;
+    const int e = b / 8 + 2;
+    const int64_t lo = (int64_t)(8 + b % 8) << (e - 3);
+    return lo + ((int64_t) 1 << (e - 3)) / 2;
+}
+
+//! Statistics are only written by the thread they belong to, but a snapshot
+//! may read them at the same time.  They are stored and loaded atomically,
+//! one field at a time, so a snapshot may see some fields updated for a scope
+//! and others not yet.
+static inline void stat_set(int64_t *p, int64_t v)
+{
+    __atomic_store_n(p, v, __ATOMIC_RELAXED);
+}
+
+static inline void stat_add(int64_t *p, int64_t v)
+{
+    stat_set(p, *p + v);
+}
+
+static inline int64_t stat_get(const int64_t *p)
+{
+    return __atomic_load_n(p, __ATOMIC_RELAXED);
+}
+
+//! Add a scope that ended now to the statistics of its tag.
+static void tag_aggregate(const scope_t *scope,
+                          int64_t wall_nsec,
+                          int64_t cpu_nsec,
+                          const struct rusage *ru)
+{
+    tagstate_t *ts = tag_lookup(scope->tag);
+    if (!ts)
+        return;
+    tagstats_t *st = ts->stats;
+    const int first = !st;
+    if (first) {
+        st = calloc(1, sizeof(tagstats_t));
+        if (!st)
+            return;
+        st->wall_min = INT64_MAX;
+    }
+    const int64_t walldur = wall_nsec - scope->wall_time;
+    stat_add(&st->count, 1);
+    stat_add(&st->wall_total, walldur);
+    stat_add(&st->cpu_total, cpu_nsec - scope->cpu_time);
+    if (walldur < st->wall_min)
+        stat_set(&st->wall_min, walldur);
+    if (walldur > st->wall_max)
+        stat_set(&st->wall_max, walldur);
+    stat_add(&st->preempted, ru->ru_nivcsw - scope->num_preemptive_switch);
+    stat_add(&st->voluntary, ru->ru_nvcsw - scope->num_voluntary_switch);
+    stat_add(&st->hist[hist_bucket(walldur)], 1);
+    // Publish the statistics to snapshots once they hold a scope.
+    if (first)
+        __atomic_store_n(&ts->stats, st, __ATOMIC_RELEASE);
+}
+
 #if defined(__APPLE__)
 static int getrusage_thread(struct rusage *rusage)
 {
@@ -95,17 +807,86 @@ static int getrusage_thread(struct rusage *rusage)
 }
 #endif
 
+static int64_t wall_now(void)
+{
+    struct timespec wt;
+    clock_gettime(CLOCK_MONOTONIC, &wt);
+    return wt.tv_sec * 1000000000 + wt.tv_nsec;
+}
+
+//! Mark the start of a wait of the calling thread, if breaking down off-CPU
+//! time.
+void tt_wait_begin(enum tt_wait_reason reason)
+{
+    if (tidx < 0 || !offcputhreshold || waitdepth++)
+        return;
+    waitreason = reason;
+    waitstart = wall_now();
+}
+
+//! Mark the end of the wait of the calling thread.
+void tt_wait_end(void)
+{
+    if (tidx < 0 || !offcputhreshold || !waitdepth || --waitdepth)
+        return;
+    threadcounts[tidx].waittotals[waitreason] += wall_now() - waitstart;
+}
+
 //! Record a timestamp.
 int tt_stamp(const char *cat, const char *tag, const char *phase)
 {
-    if (!isrecording) {
-        if (!numthreads)
-            fprintf(stderr,
-                    "ThreadTracer: ERROR. Threads did not sign in yet. Cannot "
-                    "record.\n");
+    return tt_stamp_id(cat, tag, phase, 0);
+}
+
+//! Record a timestamp for an event that carries an id.
+//! Threads that did not sign in are not traced, so that ThreadKit itself can
+//! be instrumented at no cost to applications that do not trace.
+int tt_stamp_id(const char *cat,
+                const char *tag,
+                const char *phase,
+                uint64_t id)
+{
+    if (tidx < 0 || !atomic_load_explicit(&isrecording, memory_order_relaxed))
         return -1;
+
+    if (!category_enabled(cat))
+        return -1;
+
+    // Pair "E" events with their scope before anything else, so that the end
+    // of a scope that was not sampled is dropped too.
+    const scope_t *scope = NULL;
+    int begin = SCOPE_UNMATCHED;
+    switch (phase[0]) {
+    case 'E':
+        scope = scope_pop(tag);
+        if (scope)
+            begin = scope->begin;
+        if (begin == SCOPE_SKIPPED || (aggregating && !scope))
+            return -1;
+        break;
+    case 'B':
+        if (!tag_sampled(tag)) {
+            scope_push(tag, SCOPE_SKIPPED);
+            return -1;
+        }
+        break;
+    case 'i':
+    case 'C':
+        if (aggregating || !tag_sampled(tag))
+            return -1;
+        break;
+    default:
+        // Only scopes are aggregated.
+        if (aggregating)
+            return -1;
+        break;
     }
 
+    int64_t perf[NUMPERF];
+    const int counting = perfcounters[tidx].fds[0] >= 0 &&
+                         (phase[0] == 'B' || phase[0] == 'E') && !aggregating;
+    if (counting && phase[0] == 'E')
+        perf_read(perf);
     struct timespec wt, ct;
     clock_gettime(CLOCK_MONOTONIC, &wt);
     clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ct);
@@ -117,7 +898,7 @@ int tt_stamp(const char *cat, const char *tag, const char *phase)
     rv = getrusage(RUSAGE_THREAD, &ru);
 #endif
     if (rv < 0) {
-        isrecording = 0;
+        atomic_store(&isrecording, 0);
         fprintf(stderr, "ThreadTracer: rusage() failed. Stopped Recording.\n");
         return -1;
     }
@@ -128,136 +909,1082 @@ int tt_stamp(const char *cat, const char *tag, const char *phase)
     if (wall_nsec < wallcutoff)
         return -1;
 
-    const int cnt = samplecounts[tidx];
+    if (aggregating) {
+        if (scope) {
+            tag_aggregate(scope, wall_nsec, cpu_nsec, &ru);
+            return 0;
+        }
+        scope_t *pushed = scope_push(tag, 0);
+        if (pushed) {
+            pushed->wall_time = wall_nsec;
+            pushed->cpu_time = cpu_nsec;
+            pushed->num_preemptive_switch = ru.ru_nivcsw;
+            pushed->num_voluntary_switch = ru.ru_nvcsw;
+        }
+        return 0;
+    }
+
+    const int cnt = atomic_load_explicit(&threadcounts[tidx].samplecount,
+                                         memory_order_relaxed);
+
+    if (begin >= 0 && minduration &&
+        wall_nsec - walloffset - samples[tidx][begin].wall_time < minduration) {
+        // Discard this short scope.  If nothing was recorded inside it, its
+        // "B" sample can be reclaimed, otherwise it is dropped in the report.
+        if (begin == cnt - 1) {
+            atomic_store_explicit(&threadcounts[tidx].samplecount, begin,
+                                  memory_order_release);
+            if (tracefiles[tidx])
+                atomic_store_explicit(&tracefiles[tidx]->samplecount, begin,
+                                      memory_order_release);
+        } else
+            __atomic_store_n(&samples[tidx][begin].phase, NULL,
+                             __ATOMIC_RELAXED);
+        return -1;
+    }
+
     if (cnt >= MAXSAMPLES) {
-        isrecording = 0;
+        atomic_store(&isrecording, 0);
         fprintf(stderr,
                 "ThreadTracer: Stopped recording samples. Limit(%d) "
                 "reached.\n",
                 MAXSAMPLES);
         return -1;
     }
-    sample_t *sample = samples[tidx] + samplecounts[tidx];
+    sample_t *sample = samples[tidx] + cnt;
     sample->wall_time = wall_nsec - walloffset;
     sample->cpu_time = cpu_nsec;
     sample->num_preemptive_switch = ru.ru_nivcsw;
     sample->num_voluntary_switch = ru.ru_nvcsw;
     sample->tag = tag;
     sample->cat = cat;
-    sample->phase = phase;
-    return samplecounts[tidx]++;
+    __atomic_store_n(&sample->phase, phase, __ATOMIC_RELAXED);
+    sample->begin = begin;
+    sample->id = id;
+    if (phase[0] == 'B')
+        scope_push(tag, cnt);
+    if (offcputhreshold && (phase[0] == 'B' || phase[0] == 'E'))
+        memcpy(waitsamples[tidx][cnt], threadcounts[tidx].waittotals,
+               sizeof(threadcounts[tidx].waittotals));
+    if (counting) {
+        // Read the counters of a "B" last, so that they count as little of
+        // ThreadTracer itself as possible.
+        if (phase[0] == 'B')
+            perf_read(perf);
+        memcpy(perfsamples[tidx][cnt], perf, sizeof(perf));
+    }
+    if (tracefiles[tidx]) {
+        tracefile_string(cat);
+        tracefile_string(tag);
+        tracefile_string(phase);
+        atomic_store_explicit(&tracefiles[tidx]->samplecount, cnt + 1,
+                              memory_order_release);
+    }
+    atomic_store_explicit(&threadcounts[tidx].samplecount, cnt + 1,
+                          memory_order_release);
+    return cnt;
+}
 
-    fprintf(stderr,
-            "ThreadTracer: Thread(%" PRIu64
-            ") was not signed in before recording the first time stamp.\n",
-            (uint64_t) threadids[tidx]);
-    fprintf(stderr,
-            "ThreadTracer: Recording has stopped due to sign-in error.\n");
-    isrecording = 0;
-    return -1;
+//! Record the value of a counter.
+int tt_counter(const char *cat, const char *name, int64_t value)
+{
+    return tt_stamp_id(cat, name, "C", (uint64_t) value);
 }
 
-int tt_report(const char *user_oname)
+//! The report is formatted into a large buffer, written out a chunk at a time.
+#define WRITERBUFSIZE 256 * 1024
+
+typedef struct {
+    int fd;      //!< file descriptor we are writing to
+    int failed;  //!< set if a write() failed
+    size_t len;  //!< number of bytes buffered
+    char buf[WRITERBUFSIZE];
+} writer_t;
+
+static void writer_flush(writer_t *w)
 {
-    char default_oname[256];
-    const char *oname;
+    const char *p = w->buf;
+    size_t left = w->len;
+    while (left && !w->failed) {
+        ssize_t rv = write(w->fd, p, left);
+        if (rv < 0) {
+            if (errno == EINTR)
+                continue;
+            w->failed = 1;
+            break;
+        }
+        p += rv;
+        left -= rv;
+    }
+    w->len = 0;
+}
 
-    isrecording = 0;
-    if (!user_oname) {
-        long pid = (long) getpid();
-        snprintf(default_oname, 256, "threadtracer.%ld.json", pid);
-        oname = default_oname;
-    } else {
-        oname = user_oname;
+//! Make room for at least 'n' more bytes in the buffer.
+static inline char *writer_reserve(writer_t *w, size_t n)
+{
+    if (w->len + n > sizeof(w->buf))
+        writer_flush(w);
+    return w->buf + w->len;
+}
+
+static void writer_bytes(writer_t *w, const char *s, size_t n)
+{
+    while (n) {
+        size_t chunk = n < sizeof(w->buf) ? n : sizeof(w->buf);
+        memcpy(writer_reserve(w, chunk), s, chunk);
+        w->len += chunk;
+        s += chunk;
+        n -= chunk;
     }
+}
 
-    if (numthreads == 0) {
-        fprintf(stderr,
-                "ThreadTracer: Nothing to report, 0 threads signed in.\n");
+static void writer_str(writer_t *w, const char *s)
+{
+    writer_bytes(w, s, strlen(s));
+}
+
+static void writer_int(writer_t *w, int64_t v)
+{
+    char tmp[24];
+    char *p = tmp + sizeof(tmp);
+    uint64_t u = v < 0 ? -(uint64_t) v : (uint64_t) v;
+    do {
+        *--p = '0' + u % 10;
+        u /= 10;
+    } while (u);
+    if (v < 0)
+        *--p = '-';
+    size_t n = tmp + sizeof(tmp) - p;
+    memcpy(writer_reserve(w, n), p, n);
+    w->len += n;
+}
+
+//! Write 's' as a quoted CSV field.
+static void writer_csv(writer_t *w, const char *s)
+{
+    writer_str(w, "\"");
+    for (const char *c = s ? s : ""; *c; ++c) {
+        char *p = writer_reserve(w, 2);
+        if (*c == '"')
+            *p++ = '"';
+        *p = *c;
+        w->len = p + 1 - w->buf;
+    }
+    writer_str(w, "\"");
+}
+
+static void writer_hex(writer_t *w, uint64_t v)
+{
+    static const char hex[] = "0123456789abcdef";
+    char tmp[16];
+    char *p = tmp + sizeof(tmp);
+    do {
+        *--p = hex[v & 0xf];
+        v >>= 4;
+    } while (v);
+    size_t n = tmp + sizeof(tmp) - p;
+    memcpy(writer_reserve(w, n), p, n);
+    w->len += n;
+}
+
+//! Write 's' as the contents of a JSON string, escaping where needed.
+static void writer_escaped(writer_t *w, const char *s)
+{
+    static const char hex[] = "0123456789abcdef";
+    for (const unsigned char *c = (const unsigned char *) (s ? s : ""); *c;
+         ++c) {
+        char *p = writer_reserve(w, 6);
+        if (*c == '"' || *c == '\\') {
+            p[0] = '\\';
+            p[1] = *c;
+            w->len += 2;
+        } else if (*c < 0x20) {
+            p[0] = '\\';
+            p[1] = 'u';
+            p[2] = '0';
+            p[3] = '0';
+            p[4] = hex[*c >> 4];
+            p[5] = hex[*c & 0xf];
+            w->len += 6;
+        } else {
+            p[0] = *c;
+            w->len += 1;
+        }
+    }
+}
+
+//! The hardware counters over the scope that sample 'end' of thread 't' ends.
+//! Returns 0, or -1 if they were not read.
+static int perf_deltas(int t, int end, int begin, int64_t *deltas)
+{
+    if (perfcounters[t].fds[0] < 0)
         return -1;
+    for (int i = 0; i < NUMPERF; ++i) {
+        if (perfsamples[t][end][i] < 0 || perfsamples[t][begin][i] < 0)
+            return -1;
+        deltas[i] = perfsamples[t][end][i] - perfsamples[t][begin][i];
     }
-    FILE *f = fopen(oname, "w");
-    if (!f)
+    return 0;
+}
+
+//! The phase of a sample, or NULL if the minimum duration filter dropped it.
+//! The owning thread may drop it while a snapshot reads it, so a report
+//! loads it once and only uses what it loaded.
+static inline const char *sample_phase(const sample_t *sample)
+{
+    return __atomic_load_n(&sample->phase, __ATOMIC_RELAXED);
+}
+
+//! The time spent waiting per reason, over the scope that sample 'end' of
+//! thread 't' ends, if its duty cycle is low enough to break it down.
+//! Returns 0, or -1 if not.
+static int wait_deltas(int t,
+                       int end,
+                       int begin,
+                       int64_t dutycycle,
+                       int64_t *deltas)
+{
+    if (!offcputhreshold || dutycycle >= offcputhreshold)
         return -1;
+    for (int i = 0; i < TT_WAIT_REASONS; ++i)
+        deltas[i] = waitsamples[t][end][i] - waitsamples[t][begin][i];
+    return 0;
+}
 
+//! Instructions per cycle, in percent.
+static int64_t perf_ipc(const int64_t *deltas)
+{
+    return deltas[0] ? 100 * deltas[1] / deltas[0] : 0;
+}
+
+//! Write the recorded events as Chrome tracing JSON.
+//! Returns the number of events written.
+static int report_events(writer_t *w,
+                         int nthreads,
+                         int64_t pid,
+                         int *discarded_out)
+{
     int total = 0;
     int discarded = 0;
-    fprintf(f, "{\"traceEvents\":[\n");
+    writer_str(w, "{\"traceEvents\":[\n");
 
-    for (int t = 0; t < numthreads; ++t) {
-        for (int s = 0; s < samplecounts[t]; ++s) {
+    for (int t = 0; t < nthreads; ++t) {
+        if (!atomic_load_explicit(&slotready[t], memory_order_acquire))
+            continue;
+        const uint64_t tid = (uint64_t) threadids[t];
+        const int cnt = atomic_load_explicit(&threadcounts[t].samplecount,
+                                             memory_order_acquire);
+        for (int s = 0; s < cnt; ++s) {
             const sample_t *sample = samples[t] + s;
+            const sample_t *beginsample = NULL;
+
+            // Dropped by the minimum duration filter.
+            const char *phase = sample_phase(sample);
+            if (!phase)
+                continue;
 
-            char argstr[128];
-            if (sample->phase[0] == 'E') {
-                if (s == 0) {
+            if (phase[0] == 'E') {
+                if (sample->begin < 0) {
                     discarded++;
-                    goto notfound;
+                    continue;
                 }
-                int i = s - 1;
-                while (strcmp(samples[t][i].tag, sample->tag) ||
-                       samples[t][i].phase[0] != 'B') {
-                    i--;
-                    if (i < 0) {
-                        discarded++;
-                        goto notfound;
-                    }
-                };
-                const sample_t *beginsample = samples[t] + i;
-                int64_t preempted = sample->num_preemptive_switch -
-                                    beginsample->num_preemptive_switch;
-                int64_t voluntary = sample->num_voluntary_switch -
-                                    beginsample->num_voluntary_switch;
+                beginsample = samples[t] + sample->begin;
+            }
+
+            if (total)
+                writer_str(w, ",\n");
+            writer_str(w, "{\"cat\":\"");
+            writer_escaped(w, sample->cat);
+            writer_str(w, "\",\"pid\":");
+            writer_int(w, pid);
+            writer_str(w, ",\"tid\":");
+            writer_int(w, (int64_t) tid);
+            writer_str(w, ",\"ts\":");
+            writer_int(w, sample->wall_time / 1000);
+            writer_str(w, ",\"tts\":");
+            writer_int(w, sample->cpu_time / 1000);
+            writer_str(w, ",\"ph\":\"");
+            writer_escaped(w, phase);
+            writer_str(w, "\",\"name\":\"");
+            writer_escaped(w, sample->tag);
+            writer_str(w, "\"");
+            switch (phase[0]) {
+            case 'f':
+                // Bind the end of a flow to the enclosing slice, rather
+                // than to the next slice that begins.
+                writer_str(w, ",\"bp\":\"e\"");
+                /* fall through */
+            case 'b':
+            case 'e':
+            case 's':
+                writer_str(w, ",\"id\":\"0x");
+                writer_hex(w, sample->id);
+                writer_str(w, "\"");
+                break;
+            case 'i':
+                // Instant events are scoped to the thread that recorded them.
+                writer_str(w, ",\"s\":\"t\"");
+                break;
+            }
+            writer_str(w, ",\"args\":{");
+            if (beginsample) {
                 int64_t walldur = sample->wall_time - beginsample->wall_time;
                 int64_t cpudur = sample->cpu_time - beginsample->cpu_time;
-                int64_t dutycycle = 100 * cpudur / walldur;
-                snprintf(argstr, sizeof(argstr),
-                         "{\"preempted\":%" PRIu64 ",\"voluntary\":%" PRIu64
-                         ",\"dutycycle(%%)\":%" PRIu64 "}",
-                         preempted, voluntary, dutycycle);
-            } else
-                snprintf(argstr, sizeof(argstr), "{}");
+                writer_str(w, "\"preempted\":");
+                writer_int(w, sample->num_preemptive_switch -
+                                  beginsample->num_preemptive_switch);
+                writer_str(w, ",\"voluntary\":");
+                writer_int(w, sample->num_voluntary_switch -
+                                  beginsample->num_voluntary_switch);
+                const int64_t dutycycle =
+                    walldur ? 100 * cpudur / walldur : 100;
+                writer_str(w, ",\"dutycycle(%)\":");
+                writer_int(w, dutycycle);
+                int64_t waits[TT_WAIT_REASONS];
+                if (wait_deltas(t, s, sample->begin, dutycycle, waits) == 0) {
+                    int64_t other = walldur - cpudur;
+                    for (int i = 0; i < TT_WAIT_REASONS; ++i) {
+                        writer_str(w, ",\"");
+                        writer_str(w, waitnames[i]);
+                        writer_str(w, "\":");
+                        writer_int(w, waits[i] / 1000);
+                        other -= waits[i];
+                    }
+                    writer_str(w, ",\"wait_other(us)\":");
+                    writer_int(w, other > 0 ? other / 1000 : 0);
+                }
+                int64_t deltas[NUMPERF];
+                if (perf_deltas(t, s, sample->begin, deltas) == 0) {
+                    for (int i = 0; i < NUMPERF; ++i) {
+                        writer_str(w, ",\"");
+                        writer_str(w, perfnames[i]);
+                        writer_str(w, "\":");
+                        writer_int(w, deltas[i]);
+                    }
+                    writer_str(w, ",\"ipc(%)\":");
+                    writer_int(w, perf_ipc(deltas));
+                }
+            } else if (phase[0] == 'C') {
+                writer_str(w, "\"value\":");
+                writer_int(w, sample->value);
+            }
+            writer_str(w, "}}");
+            total++;
+        }
+    }
+    for (int t = 0; t < nthreads; ++t) {
+        if (!atomic_load_explicit(&slotready[t], memory_order_acquire))
+            continue;
+        writer_str(w, ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\":");
+        writer_int(w, pid);
+        writer_str(w, ", \"tid\":");
+        writer_int(w, (int64_t)(uint64_t) threadids[t]);
+        writer_str(w, ", \"args\": { \"name\" : \"");
+        writer_escaped(w, threadnames[t]);
+        writer_str(w, "\" } }");
+    }
 
-            if (total)
-                fprintf(f, ",\n");
-            fprintf(f,
-                    "{\"cat\":\"%s\","
-                    "\"pid\":%" PRIu64
-                    ","
-                    "\"tid\":%" PRIu64
-                    ","
-                    "\"ts\":%" PRIu64
-                    ","
-                    "\"tts\":%" PRIu64
-                    ","
-                    "\"ph\":\"%s\","
-                    "\"name\":\"%s\","
-                    "\"args\":%s}",
-                    sample->cat, (uint64_t) getpid(), (uint64_t) threadids[t],
-                    sample->wall_time / 1000, sample->cpu_time / 1000,
-                    sample->phase, sample->tag, argstr);
+    writer_str(w, "\n],\"otherData\":{\"clock\":\"CLOCK_MONOTONIC\","
+                  "\"clock_offset_ns\":");
+    writer_int(w, walloffset);
+    writer_str(w, "}}\n");
+    *discarded_out = discarded;
+    return total;
+}
+
+//! A protobuf message being encoded, for the Perfetto report.  Like
+//! Perfetto's own encoder, nested messages get a 4 byte length field that is
+//! patched when they end, so that they can be written in one pass.
+typedef struct {
+    char *buf;
+    size_t len, cap;
+    int failed;  //!< set if the buffer could not grow
+} pb_t;
+
+//! Make room for at least 'n' more bytes, or return NULL.
+static char *pb_reserve(pb_t *pb, size_t n)
+{
+    if (pb->failed)
+        return NULL;
+    if (pb->len + n > pb->cap) {
+        size_t cap = pb->cap ? pb->cap : 1024;
+        while (pb->len + n > cap)
+            cap *= 2;
+        char *buf = realloc(pb->buf, cap);
+        if (!buf) {
+            pb->failed = 1;
+            return NULL;
+        }
+        pb->buf = buf;
+        pb->cap = cap;
+    }
+    return pb->buf + pb->len;
+}
+
+static void pb_varint(pb_t *pb, uint64_t v)
+{
+    char *p = pb_reserve(pb, 10);
+    if (!p)
+        return;
+    while (v >= 0x80) {
+        *p++ = (char) (v | 0x80);
+        v >>= 7;
+    }
+    *p++ = (char) v;
+    pb->len = p - pb->buf;
+}
+
+//! Protobuf wire types.
+#define PB_VARINT 0
+#define PB_FIXED64 1
+#define PB_LEN 2
+
+static void pb_uint(pb_t *pb, int field, uint64_t v)
+{
+    pb_varint(pb, field << 3 | PB_VARINT);
+    pb_varint(pb, v);
+}
+
+static void pb_fixed64(pb_t *pb, int field, uint64_t v)
+{
+    pb_varint(pb, field << 3 | PB_FIXED64);
+    char *p = pb_reserve(pb, 8);
+    if (!p)
+        return;
+    for (int i = 0; i < 8; ++i)
+        p[i] = (char) (v >> 8 * i);
+    pb->len += 8;
+}
+
+static void pb_string(pb_t *pb, int field, const char *s)
+{
+    size_t n = s ? strlen(s) : 0;
+    pb_varint(pb, field << 3 | PB_LEN);
+    pb_varint(pb, n);
+    char *p = pb_reserve(pb, n);
+    if (!p)
+        return;
+    memcpy(p, s, n);
+    pb->len += n;
+}
+
+//! Start a nested message.  Returns where it starts, for pb_end().
+static size_t pb_begin(pb_t *pb, int field)
+{
+    pb_varint(pb, field << 3 | PB_LEN);
+    if (pb_reserve(pb, 4))
+        pb->len += 4;
+    return pb->len;
+}
+
+//! End a nested message, filling in its length as a padded varint.
+static void pb_end(pb_t *pb, size_t start)
+{
+    if (pb->failed)
+        return;
+    size_t n = pb->len - start;
+    char *p = pb->buf + start - 4;
+    p[0] = (char) (n | 0x80);
+    p[1] = (char) (n >> 7 | 0x80);
+    p[2] = (char) (n >> 14 | 0x80);
+    p[3] = (char) (n >> 21 & 0x7f);
+}
+
+//! Write the message in 'pb' as a packet of the trace, and empty 'pb'.
+static void writer_packet(writer_t *w, pb_t *pb)
+{
+    if (pb->failed) {
+        w->failed = 1;
+    } else {
+        // Trace.packet is field 1.
+        char hdr[11] = {1 << 3 | PB_LEN};
+        size_t n = 1;
+        for (uint64_t v = pb->len; ; v >>= 7) {
+            hdr[n++] = (char) (v < 0x80 ? v : (v & 0x7f) | 0x80);
+            if (v < 0x80)
+                break;
+        }
+        writer_bytes(w, hdr, n);
+        writer_bytes(w, pb->buf, pb->len);
+    }
+    pb->len = 0;
+}
+
+//! Field numbers from Perfetto's protos/perfetto/trace/*.proto.
+enum {
+    TRACEPACKET_TIMESTAMP = 8,
+    TRACEPACKET_SEQUENCE_ID = 10,
+    TRACEPACKET_TRACK_EVENT = 11,
+    TRACEPACKET_SEQUENCE_FLAGS = 13,
+    TRACEPACKET_TRACK_DESCRIPTOR = 60,
+    TRACKDESCRIPTOR_UUID = 1,
+    TRACKDESCRIPTOR_NAME = 2,
+    TRACKDESCRIPTOR_PROCESS = 3,
+    TRACKDESCRIPTOR_THREAD = 4,
+    TRACKDESCRIPTOR_PARENT_UUID = 5,
+    TRACKDESCRIPTOR_COUNTER = 8,
+    PROCESSDESCRIPTOR_PID = 1,
+    THREADDESCRIPTOR_PID = 1,
+    THREADDESCRIPTOR_TID = 2,
+    THREADDESCRIPTOR_THREAD_NAME = 5,
+    TRACKEVENT_DEBUG_ANNOTATIONS = 4,
+    TRACKEVENT_TYPE = 9,
+    TRACKEVENT_TRACK_UUID = 11,
+    TRACKEVENT_THREAD_TIME_ABSOLUTE_US = 17,
+    TRACKEVENT_CATEGORIES = 22,
+    TRACKEVENT_NAME = 23,
+    TRACKEVENT_COUNTER_VALUE = 30,
+    TRACKEVENT_FLOW_IDS = 47,
+    TRACKEVENT_TERMINATING_FLOW_IDS = 48,
+    DEBUGANNOTATION_INT_VALUE = 4,
+    DEBUGANNOTATION_NAME = 10,
+};
+
+enum {
+    TYPE_SLICE_BEGIN = 1,
+    TYPE_SLICE_END = 2,
+    TYPE_INSTANT = 3,
+    TYPE_COUNTER = 4,
+};
+
+#define SEQ_INCREMENTAL_STATE_CLEARED 1
+
+//! The track uuids: the process track, a track per thread, per counter, and
+//! per async id, kept apart by their top bits.
+#define UUID_PROCESS(pid) ((uint64_t) (pid) << 32)
+#define UUID_THREAD(pid, t) (UUID_PROCESS(pid) | 1u << 24 | (t))
+#define UUID_COUNTER(pid, c) (UUID_PROCESS(pid) | 2u << 24 | (c))
+#define UUID_ASYNC(pid, id) \
+    (((uint64_t) (id) * 0x9e3779b97f4a7c15ull ^ (uint64_t) (pid)) | 1ull << 63)
+
+static void pb_annotation(pb_t *pb, const char *name, int64_t v)
+{
+    size_t a = pb_begin(pb, TRACKEVENT_DEBUG_ANNOTATIONS);
+    pb_string(pb, DEBUGANNOTATION_NAME, name);
+    pb_uint(pb, DEBUGANNOTATION_INT_VALUE, (uint64_t) v);
+    pb_end(pb, a);
+}
+
+//! Write a packet that ends the innermost slice on 'track' at the time of
+//! 'sample'.
+static void writer_slice_end(writer_t *w,
+                             pb_t *pb,
+                             const sample_t *sample,
+                             uint64_t seq,
+                             uint64_t track)
+{
+    pb_uint(pb, TRACEPACKET_TIMESTAMP, sample->wall_time + walloffset);
+    pb_uint(pb, TRACEPACKET_SEQUENCE_ID, seq);
+    size_t m = pb_begin(pb, TRACEPACKET_TRACK_EVENT);
+    pb_uint(pb, TRACKEVENT_TYPE, TYPE_SLICE_END);
+    pb_uint(pb, TRACKEVENT_TRACK_UUID, track);
+    pb_uint(pb, TRACKEVENT_THREAD_TIME_ABSOLUTE_US, sample->cpu_time / 1000);
+    pb_end(pb, m);
+    writer_packet(w, pb);
+}
+
+//! Write the recorded events as a Perfetto trace, a sequence of TracePacket
+//! messages.  Each thread writes its own packet sequence, which starts with
+//! the descriptor of its track.  Flow ends and starts become instants, as
+//! they are not part of a slice.  A SLICE_END ends the innermost slice of its
+//! track, so an "E" that closes scopes left open inside its own ends those
+//! first.
+//! Returns the number of events written.
+static int report_perfetto(writer_t *w,
+                           int nthreads,
+                           int64_t pid,
+                           int *discarded_out)
+{
+    int total = 0;
+    int discarded = 0;
+    const char *counters[MAXTAGS];
+    int numcounters = 0;
+    pb_t pb = {NULL, 0, 0, 0};
+    size_t m, d;
+
+    m = pb_begin(&pb, TRACEPACKET_TRACK_DESCRIPTOR);
+    pb_uint(&pb, TRACKDESCRIPTOR_UUID, UUID_PROCESS(pid));
+    d = pb_begin(&pb, TRACKDESCRIPTOR_PROCESS);
+    pb_uint(&pb, PROCESSDESCRIPTOR_PID, pid);
+    pb_end(&pb, d);
+    pb_end(&pb, m);
+    writer_packet(w, &pb);
+
+    for (int t = 0; t < nthreads; ++t) {
+        if (!atomic_load_explicit(&slotready[t], memory_order_acquire))
+            continue;
+        // Sequences must be unique among merged traces too.
+        const uint64_t seq = (uint64_t) pid << 8 | (t + 1);
+        const uint64_t track = UUID_THREAD(pid, t);
+
+        pb_uint(&pb, TRACEPACKET_SEQUENCE_ID, seq);
+        pb_uint(&pb, TRACEPACKET_SEQUENCE_FLAGS,
+                SEQ_INCREMENTAL_STATE_CLEARED);
+        m = pb_begin(&pb, TRACEPACKET_TRACK_DESCRIPTOR);
+        pb_uint(&pb, TRACKDESCRIPTOR_UUID, track);
+        pb_uint(&pb, TRACKDESCRIPTOR_PARENT_UUID, UUID_PROCESS(pid));
+        d = pb_begin(&pb, TRACKDESCRIPTOR_THREAD);
+        pb_uint(&pb, THREADDESCRIPTOR_PID, pid);
+        pb_uint(&pb, THREADDESCRIPTOR_TID, threadtids[t]);
+        pb_string(&pb, THREADDESCRIPTOR_THREAD_NAME, threadnames[t]);
+        pb_end(&pb, d);
+        pb_end(&pb, m);
+        writer_packet(w, &pb);
+
+        // The "B" samples of the slices open on the thread track.
+        int open[MAXDEPTH];
+        int numopen = 0;
+
+        const int cnt = atomic_load_explicit(&threadcounts[t].samplecount,
+                                             memory_order_acquire);
+        for (int s = 0; s < cnt; ++s) {
+            const sample_t *sample = samples[t] + s;
+            const sample_t *beginsample = NULL;
+            uint64_t eventtrack = track;
+            int type;
+
+            // Dropped by the minimum duration filter.
+            const char *phase = sample_phase(sample);
+            if (!phase)
+                continue;
+
+            switch (phase[0]) {
+            case 'B':
+            case 'b':
+                type = TYPE_SLICE_BEGIN;
+                break;
+            case 'E':
+                if (sample->begin < 0) {
+                    discarded++;
+                    continue;
+                }
+                beginsample = samples[t] + sample->begin;
+                type = TYPE_SLICE_END;
+                break;
+            case 'e':
+                type = TYPE_SLICE_END;
+                break;
+            case 'C':
+                type = TYPE_COUNTER;
+                break;
+            default:
+                type = TYPE_INSTANT;
+                break;
+            }
+
+            if (phase[0] == 'B' && numopen < MAXDEPTH) {
+                open[numopen++] = s;
+            } else if (beginsample) {
+                int d = numopen - 1;
+                while (d >= 0 && open[d] != sample->begin)
+                    d--;
+                for (; d >= 0 && numopen - 1 > d; --numopen)
+                    writer_slice_end(w, &pb, sample, seq, track);
+                if (d >= 0)
+                    numopen--;
+            }
+
+            if (phase[0] == 'b' || phase[0] == 'e')
+                eventtrack = UUID_ASYNC(pid, sample->id);
+
+            // Async tracks and counter tracks are described where they are
+            // first used.  Describing an async track again is harmless.
+            if (phase[0] == 'b') {
+                pb_uint(&pb, TRACEPACKET_SEQUENCE_ID, seq);
+                m = pb_begin(&pb, TRACEPACKET_TRACK_DESCRIPTOR);
+                pb_uint(&pb, TRACKDESCRIPTOR_UUID, eventtrack);
+                pb_uint(&pb, TRACKDESCRIPTOR_PARENT_UUID, UUID_PROCESS(pid));
+                pb_string(&pb, TRACKDESCRIPTOR_NAME, sample->tag);
+                pb_end(&pb, m);
+                writer_packet(w, &pb);
+            } else if (phase[0] == 'C') {
+                int c = 0;
+                while (c < numcounters && strcmp(counters[c], sample->tag))
+                    c++;
+                if (c == MAXTAGS) {
+                    discarded++;
+                    continue;
+                }
+                if (c == numcounters) {
+                    counters[numcounters++] = sample->tag;
+                    pb_uint(&pb, TRACEPACKET_SEQUENCE_ID, seq);
+                    m = pb_begin(&pb, TRACEPACKET_TRACK_DESCRIPTOR);
+                    pb_uint(&pb, TRACKDESCRIPTOR_UUID, UUID_COUNTER(pid, c));
+                    pb_uint(&pb, TRACKDESCRIPTOR_PARENT_UUID,
+                            UUID_PROCESS(pid));
+                    pb_string(&pb, TRACKDESCRIPTOR_NAME, sample->tag);
+                    d = pb_begin(&pb, TRACKDESCRIPTOR_COUNTER);
+                    pb_end(&pb, d);
+                    pb_end(&pb, m);
+                    writer_packet(w, &pb);
+                }
+                eventtrack = UUID_COUNTER(pid, c);
+            }
+
+            pb_uint(&pb, TRACEPACKET_TIMESTAMP, sample->wall_time + walloffset);
+            pb_uint(&pb, TRACEPACKET_SEQUENCE_ID, seq);
+            m = pb_begin(&pb, TRACEPACKET_TRACK_EVENT);
+            pb_uint(&pb, TRACKEVENT_TYPE, type);
+            pb_uint(&pb, TRACKEVENT_TRACK_UUID, eventtrack);
+            if (type != TYPE_SLICE_END) {
+                pb_string(&pb, TRACKEVENT_CATEGORIES, sample->cat);
+                pb_string(&pb, TRACKEVENT_NAME, sample->tag);
+            }
+            if (eventtrack == track)
+                pb_uint(&pb, TRACKEVENT_THREAD_TIME_ABSOLUTE_US,
+                        sample->cpu_time / 1000);
+            switch (phase[0]) {
+            case 's':
+                pb_fixed64(&pb, TRACKEVENT_FLOW_IDS, sample->id);
+                break;
+            case 'f':
+                pb_fixed64(&pb, TRACKEVENT_TERMINATING_FLOW_IDS, sample->id);
+                break;
+            case 'C':
+                pb_uint(&pb, TRACKEVENT_COUNTER_VALUE,
+                        (uint64_t) sample->value);
+                break;
+            }
+            if (beginsample) {
+                int64_t walldur = sample->wall_time - beginsample->wall_time;
+                int64_t cpudur = sample->cpu_time - beginsample->cpu_time;
+                pb_annotation(&pb, "preempted",
+                              sample->num_preemptive_switch -
+                                  beginsample->num_preemptive_switch);
+                pb_annotation(&pb, "voluntary",
+                              sample->num_voluntary_switch -
+                                  beginsample->num_voluntary_switch);
+                const int64_t dutycycle =
+                    walldur ? 100 * cpudur / walldur : 100;
+                pb_annotation(&pb, "dutycycle(%)", dutycycle);
+                int64_t waits[TT_WAIT_REASONS];
+                if (wait_deltas(t, s, sample->begin, dutycycle, waits) == 0) {
+                    int64_t other = walldur - cpudur;
+                    for (int i = 0; i < TT_WAIT_REASONS; ++i) {
+                        pb_annotation(&pb, waitnames[i], waits[i] / 1000);
+                        other -= waits[i];
+                    }
+                    pb_annotation(&pb, "wait_other(us)",
+                                  other > 0 ? other / 1000 : 0);
+                }
+                int64_t deltas[NUMPERF];
+                if (perf_deltas(t, s, sample->begin, deltas) == 0) {
+                    for (int i = 0; i < NUMPERF; ++i)
+                        pb_annotation(&pb, perfnames[i], deltas[i]);
+                    pb_annotation(&pb, "ipc(%)", perf_ipc(deltas));
+                }
+            }
+            pb_end(&pb, m);
+            writer_packet(w, &pb);
             total++;
-            // Note: unfortunately, the chrome tracing JSON format no longer
-            // supports 'I' (instant) events.
-        notfound:
-            (void) 0;
         }
     }
-    for (int t = 0; t < numthreads; ++t) {
-        fprintf(f, ",\n{");
-        fprintf(f,
-                "\"name\": \"thread_name\", "
-                "\"ph\": \"M\", "
-                "\"pid\":%ld, "
-                "\"tid\":%" PRIu64
-                ", "
-                "\"args\": { \"name\" : \"%s\" } }",
-                (long) getpid(), (uint64_t) threadids[t], threadnames[t]);
-    }
-
-    fprintf(f, "\n]}\n");
-    fclose(f);
-    fprintf(stderr, "ThreadTracer: Wrote %d events (%d discarded) to %s\n",
-            total, discarded, oname);
+
+    free(pb.buf);
+    *discarded_out = discarded;
+    return total;
+}
+
+static int compare_wall_total(const void *a, const void *b)
+{
+    const tagstate_t *x = a, *y = b;
+    if (x->stats->wall_total != y->stats->wall_total)
+        return x->stats->wall_total < y->stats->wall_total ? 1 : -1;
+    return strcmp(x->tag, y->tag);
+}
+
+//! The duration below which a fraction 'p' of the scopes in 'st' ended.
+static int64_t percentile(const tagstats_t *st, double p)
+{
+    const int64_t rank = (int64_t)(p * st->count);
+    int64_t seen = 0;
+    for (int b = 0; b < HISTBUCKETS; ++b) {
+        seen += st->hist[b];
+        if (seen > rank) {
+            int64_t v = hist_value(b);
+            return v < st->wall_min ? st->wall_min
+                                    : v > st->wall_max ? st->wall_max : v;
+        }
+    }
+    return st->wall_max;
+}
+
+//! Merge the statistics of all threads per tag, and write them as CSV, from
+//! the highest total wall time to the lowest.
+//! Returns the number of tags written.
+static int report_aggregate(writer_t *w, int nthreads)
+{
+    tagstate_t *merged = NULL;
+    int nmerged = 0;
+    for (int t = 0; t < nthreads; ++t) {
+        if (!atomic_load_explicit(&slotready[t], memory_order_acquire))
+            continue;
+        for (int i = 0; i < MAXTAGS; ++i) {
+            const tagstate_t *ts = tagtables[t] + i;
+            const char *tag = __atomic_load_n(&ts->tag, __ATOMIC_ACQUIRE);
+            const tagstats_t *from =
+                tag ? __atomic_load_n(&ts->stats, __ATOMIC_ACQUIRE) : NULL;
+            if (!from)
+                continue;
+            int m = 0;
+            while (m < nmerged && strcmp(merged[m].tag, tag))
+                m++;
+            if (m == nmerged) {
+                tagstate_t *grown =
+                    realloc(merged, (nmerged + 1) * sizeof(tagstate_t));
+                tagstats_t *st = calloc(1, sizeof(tagstats_t));
+                if (!grown || !st) {
+                    free(st);
+                    merged = grown ? grown : merged;
+                    break;
+                }
+                merged = grown;
+                merged[m].tag = tag;
+                merged[m].stats = st;
+                st->wall_min = INT64_MAX;
+                nmerged++;
+            }
+            tagstats_t *st = merged[m].stats;
+            st->count += stat_get(&from->count);
+            st->wall_total += stat_get(&from->wall_total);
+            st->cpu_total += stat_get(&from->cpu_total);
+            const int64_t wall_min = stat_get(&from->wall_min);
+            if (wall_min < st->wall_min)
+                st->wall_min = wall_min;
+            const int64_t wall_max = stat_get(&from->wall_max);
+            if (wall_max > st->wall_max)
+                st->wall_max = wall_max;
+            st->preempted += stat_get(&from->preempted);
+            st->voluntary += stat_get(&from->voluntary);
+            for (int b = 0; b < HISTBUCKETS; ++b)
+                st->hist[b] += stat_get(&from->hist[b]);
+        }
+    }
+    if (nmerged)
+        qsort(merged, nmerged, sizeof(tagstate_t), compare_wall_total);
+
+    writer_str(w,
+               "tag,count,wall_total_ns,cpu_total_ns,wall_min_ns,wall_p50_ns,"
+               "wall_p90_ns,wall_p99_ns,wall_max_ns,preempted,voluntary\n");
+    for (int m = 0; m < nmerged; ++m) {
+        const tagstats_t *st = merged[m].stats;
+        const int64_t fields[] = {
+            st->count,           st->wall_total,      st->cpu_total,
+            st->wall_min,        percentile(st, 0.5), percentile(st, 0.9),
+            percentile(st, 0.99), st->wall_max,       st->preempted,
+            st->voluntary,
+        };
+        writer_csv(w, merged[m].tag);
+        for (size_t f = 0; f < sizeof(fields) / sizeof(fields[0]); ++f) {
+            writer_str(w, ",");
+            writer_int(w, fields[f]);
+        }
+        writer_str(w, "\n");
+        free(merged[m].stats);
+    }
+    free(merged);
+    return nmerged;
+}
+
+//! Serializes reports, as snapshots can be taken from the dumper thread.
+static pthread_mutex_t reportlock = PTHREAD_MUTEX_INITIALIZER;
+
+static int report(const char *oname);
+
+//! The extension of reports that are not given a name.
+static const char *report_extension(void)
+{
+    return aggregating ? "csv" : perfetto ? "pftrace" : "json";
+}
+
+//! Should 'oname' be written as a Perfetto trace rather than JSON?
+static int is_perfetto(const char *oname)
+{
+    static const char *const suffixes[] = {".pftrace", ".perfetto-trace"};
+    const char *dot = strrchr(oname, '.');
+    if (!dot)
+        return perfetto;
+    for (size_t i = 0; i < sizeof(suffixes) / sizeof(suffixes[0]); ++i)
+        if (!strcmp(dot, suffixes[i]))
+            return 1;
+    return perfetto && strcmp(dot, ".json");
+}
+
+int tt_report(const char *user_oname)
+{
+    char default_oname[256];
+    const char *oname;
+
+    atomic_store(&isrecording, 0);
+    if (!user_oname) {
+        snprintf(default_oname, 256, "threadtracer.%ld.%s", (long) getpid(),
+                 report_extension());
+        oname = default_oname;
+    } else {
+        oname = user_oname;
+    }
+    const int total = report(oname);
+
+    // The trace files are only needed if the report was not written.
+    const int nthreads = atomic_load(&numthreads);
+    for (int t = 0; total >= 0 && t < nthreads; ++t)
+        if (tracefilenames[t])
+            unlink(tracefilenames[t]);
+    return total;
+}
+
+//! Write a report of what has been recorded so far, without stopping the
+//! recording, like a flight recorder.  Snapshots without a name are numbered.
+int tt_snapshot(const char *user_oname)
+{
+    static _Atomic int numsnapshots = 0;
+    char default_oname[256];
+    const char *oname;
+
+    if (!user_oname) {
+        snprintf(default_oname, 256, "threadtracer.%ld.%d.%s", (long) getpid(),
+                 numsnapshots++, report_extension());
+        oname = default_oname;
+    } else {
+        oname = user_oname;
+    }
+    return report(oname);
+}
+
+static int report(const char *oname)
+{
+    const int64_t pid = (int64_t) getpid();
+
+    const int nthreads = atomic_load(&numthreads);
+    if (nthreads == 0) {
+        fprintf(stderr,
+                "ThreadTracer: Nothing to report, 0 threads signed in.\n");
+        return -1;
+    }
+    writer_t *w = malloc(sizeof(writer_t));
+    if (!w)
+        return -1;
+    w->fd = open(oname, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    w->failed = 0;
+    w->len = 0;
+    if (w->fd < 0) {
+        free(w);
+        return -1;
+    }
+
+    pthread_mutex_lock(&reportlock);
+    int total, discarded = 0;
+    if (aggregating)
+        total = report_aggregate(w, nthreads);
+    else if (is_perfetto(oname))
+        total = report_perfetto(w, nthreads, pid, &discarded);
+    else
+        total = report_events(w, nthreads, pid, &discarded);
+    pthread_mutex_unlock(&reportlock);
+
+    writer_flush(w);
+    int failed = w->failed;
+    if (close(w->fd) < 0)
+        failed = 1;
+    free(w);
+    if (failed) {
+        fprintf(stderr, "ThreadTracer: Failed to write %s\n", oname);
+        return -1;
+    }
+    if (aggregating)
+        fprintf(stderr, "ThreadTracer: Wrote statistics of %d tags to %s\n",
+                total, oname);
+    else
+        fprintf(stderr,
+                "ThreadTracer: Wrote %d events (%d discarded) to %s\n", total,
+                discarded, oname);
     return total;
 }
+
+//! Snapshots can be requested from outside the process, by sending it the
+//! signal named in THREADTRACERSIGNAL (e.g. SIGUSR2), or by creating the file
+//! named in THREADTRACERCONTROL.  The signal handler only posts a semaphore,
+//! which is async-signal-safe, and a dumper thread takes the snapshot.
+static sem_t dumpsem;
+
+//! The control file, or NULL.
+static const char *controlfile;
+
+static void dump_signal_handler(int sig)
+{
+    (void) sig;
+    const int saved_errno = errno;
+    sem_post(&dumpsem);
+    errno = saved_errno;
+}
+
+static void *dumper_thread(void *arg)
+{
+    (void) arg;
+    for (;;) {
+        int requested;
+        if (controlfile) {
+            // Poll for the control file once a second.
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_sec += 1;
+            requested = !sem_timedwait(&dumpsem, &ts);
+            if (!requested && !access(controlfile, F_OK))
+                requested = !unlink(controlfile) || errno == ENOENT;
+        } else {
+            requested = !sem_wait(&dumpsem);
+        }
+        if (requested)
+            tt_snapshot(NULL);
+    }
+    return NULL;
+}
+
+static void dumper_init(void)
+{
+    const char *signame = getenv("THREADTRACERSIGNAL");
+    controlfile = getenv("THREADTRACERCONTROL");
+    if (!signame && !controlfile)
+        return;
+
+    sem_init(&dumpsem, 0, 0);
+    if (signame) {
+        int sig = !strcmp(signame, "SIGUSR1") || !strcmp(signame, "USR1")
+                      ? SIGUSR1
+                      : !strcmp(signame, "SIGUSR2") || !strcmp(signame, "USR2")
+                            ? SIGUSR2
+                            : atoi(signame);
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = dump_signal_handler;
+        sa.sa_flags = SA_RESTART;
+        sigemptyset(&sa.sa_mask);
+        if (sig <= 0 || sigaction(sig, &sa, NULL) < 0) {
+            fprintf(stderr, "ThreadTracer: Cannot handle signal %s.\n",
+                    signame);
+            if (!controlfile)
+                return;
+        } else {
+            fprintf(stderr,
+                    "ThreadTracer: writing a snapshot on signal %d.\n", sig);
+        }
+    }
+    if (controlfile)
+        fprintf(stderr,
+                "ThreadTracer: writing a snapshot when %s is created.\n",
+                controlfile);
+
+    // The dumper thread blocks all signals, so that it never runs signal
+    // handlers of the application.
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_t thread;
+    if (pthread_create(&thread, &attr, dumper_thread, NULL))
+        fprintf(stderr, "ThreadTracer: Cannot start the dumper thread.\n");
+    pthread_attr_destroy(&attr);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
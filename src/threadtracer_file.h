@@ -0,0 +1,86 @@
+#ifndef THREAD_TRACER_FILE_H
+#define THREAD_TRACER_FILE_H
+
+//! The samples of ThreadTracer, and the layout of the files that hold them
+//! when THREADTRACERMMAP is set, so that they survive a crash of the traced
+//! process.  Shared with tools/threadtracer-recover.c, which reads them.
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+//! The information we record for a trace event.
+typedef struct {
+    const char *cat;                //!< category
+    const char *tag;                //!< tag
+    const char *phase;              //!< "B", "E", ..., or NULL if dropped
+    int64_t wall_time;              //!< timestamp on wall clock
+    int64_t cpu_time;               //!< timestamp on thread's cpu clock
+    int64_t num_preemptive_switch,  //!< number of context switches (premptive)
+        num_voluntary_switch;  //!< number of context switches (cooperative)
+    int begin;                 //!< for "E": index of matching "B", or -1
+    union {
+        uint64_t id;    //!< for async and flow events: their id
+        int64_t value;  //!< for counter events: their value
+    };
+} sample_t;
+
+#define TRACEFILE_MAGIC "TTFILE2"  //!< The start of a file, and its version.
+#define TRACEFILE_STRINGBYTES (256 * 1024)  //!< Room for strings per file.
+#define TRACEFILE_WAITREASONS 3  //!< Wait totals per sample, one per reason.
+#define TRACEFILE_NUMPERF 3      //!< Hardware counters per sample.
+
+//! The args that the wait totals and hardware counters of a scope are
+//! reported as, in this order, so that recovered traces match live ones.
+#define TRACEFILE_WAITNAMES "wait_mutex(us)", "wait_condvar(us)", "wait_io(us)"
+#define TRACEFILE_PERFNAMES "cycles", "instructions", "cache-misses"
+
+//! A file starts with this header, followed by the samples, whose strings
+//! are pointers into the traced process, the wait totals and the hardware
+//! counters of the samples, and then a table that maps those pointers to the
+//! strings.  The wait totals and counters are only recorded for "B" and "E"
+//! samples, and only if offcputhreshold and perfcounting say so.
+typedef struct {
+    char magic[8];            //!< TRACEFILE_MAGIC
+    uint32_t samplesize;      //!< sizeof(sample_t)
+    uint32_t maxsamples;      //!< room for samples
+    _Atomic int samplecount;  //!< number of samples recorded
+    _Atomic uint32_t stringbytes;  //!< number of bytes used in the table
+    int64_t pid;              //!< the traced process
+    int64_t walloffset;       //!< what the timestamps are relative to
+    uint64_t threadid;        //!< the pthread_t of the thread
+    char threadname[64];      //!< the name it signed in with, maybe cut short
+    int32_t offcputhreshold;  //!< THREADTRACEROFFCPU, or 0 if not set
+    int32_t perfcounting;     //!< whether the hardware counters were read
+} tracefile_t;
+
+//! An entry in the string table, padded to a multiple of 8 bytes.
+typedef struct {
+    uint64_t key;  //!< the pointer to the string in the traced process
+    uint32_t len;  //!< strlen() of the string, which follows
+    char str[];
+} tracestring_t;
+
+//! The bytes per sample, for the sample itself, its wait totals and its
+//! hardware counters.
+#define TRACEFILE_SAMPLEBYTES \
+    (sizeof(sample_t) +       \
+     (TRACEFILE_WAITREASONS + TRACEFILE_NUMPERF) * sizeof(int64_t))
+
+//! Where the samples, wait totals, counters and string table start in a file.
+#define TRACEFILE_SAMPLES(h) ((sample_t *) ((char *) (h) + 4096))
+#define TRACEFILE_WAITS(h, maxsamples)              \
+    ((int64_t(*)[TRACEFILE_WAITREASONS])(           \
+        (char *) TRACEFILE_SAMPLES(h) +             \
+        (size_t) (maxsamples) * sizeof(sample_t)))
+#define TRACEFILE_PERF(h, maxsamples)                      \
+    ((int64_t(*)[TRACEFILE_NUMPERF])(                      \
+        (char *) TRACEFILE_WAITS(h, maxsamples) +          \
+        (size_t) (maxsamples) * TRACEFILE_WAITREASONS * sizeof(int64_t)))
+#define TRACEFILE_STRINGS(h, maxsamples) \
+    ((char *) TRACEFILE_SAMPLES(h) +     \
+     (size_t) (maxsamples) * TRACEFILE_SAMPLEBYTES)
+#define TRACEFILE_SIZE(maxsamples) \
+    (4096 + (size_t) (maxsamples) * TRACEFILE_SAMPLEBYTES + \
+     TRACEFILE_STRINGBYTES)
+
+#endif
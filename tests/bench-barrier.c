@@ -0,0 +1,86 @@
+/* Measure how long a round of a barrier takes, at different thread counts,
+ * for barrier_t, tree_barrier_t and pthread_barrier_t.
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "barrier.h"
+
+#define ROUNDS 2000
+#define MAXTHREADS 64
+
+enum kind { BARRIER, TREE, PTHREAD };
+
+static const char *const kindnames[] = {"barrier_t", "tree_barrier_t",
+                                        "pthread_barrier_t"};
+
+static barrier_t barrier;
+static tree_barrier_t tree;
+static pthread_barrier_t pbarrier;
+static enum kind kind;
+
+static void *run(void *v_index)
+{
+    const unsigned int index = (unsigned int) (uintptr_t) v_index;
+
+    for (int i = 0; i < ROUNDS; ++i) {
+        switch (kind) {
+        case BARRIER:
+            barrier_wait(&barrier);
+            break;
+        case TREE:
+            tree_barrier_wait(&tree, index);
+            break;
+        case PTHREAD:
+            pthread_barrier_wait(&pbarrier);
+            break;
+        }
+    }
+    return NULL;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void bench(enum kind k, unsigned int count)
+{
+    pthread_t threads[MAXTHREADS];
+
+    kind = k;
+    barrier_init(&barrier, count);
+    tree_barrier_init(&tree, count);
+    pthread_barrier_init(&pbarrier, NULL, count);
+
+    const double start = now();
+    for (unsigned int i = 0; i < count; ++i)
+        if (pthread_create(&threads[i], NULL, run, (void *) (uintptr_t) i))
+            abort();
+    for (unsigned int i = 0; i < count; ++i)
+        pthread_join(threads[i], NULL);
+    const double elapsed = now() - start;
+
+    printf("%-18s %3u threads: %8.2f us/round\n", kindnames[k], count,
+           elapsed * 1e6 / ROUNDS);
+
+    barrier_destroy(&barrier);
+    tree_barrier_destroy(&tree);
+    pthread_barrier_destroy(&pbarrier);
+}
+
+int main(void)
+{
+    static const unsigned int counts[] = {4, 16, 64};
+
+    for (unsigned int c = 0; c < sizeof(counts) / sizeof(counts[0]); ++c)
+        for (int k = BARRIER; k <= PTHREAD; ++k)
+            bench(k, counts[c]);
+    return 0;
+}
@@ -0,0 +1,100 @@
+/* Measure how many messages a second pass through spsc_ring_t and
+ * mpsc_ring_t, for different payload sizes, pushing and popping one message
+ * at a time or in batches.
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "ring.h"
+
+#define MESSAGES 2000000
+#define CAPACITY 1024
+#define MAXBATCH 32
+#define MAXPAYLOAD 256
+#define PRODUCERS 4
+
+static spsc_ring_t spsc;
+static mpsc_ring_t mpsc;
+static size_t batch;
+static unsigned int producers;
+
+static void *produce(void *unused)
+{
+    static char buf[MAXBATCH * MAXPAYLOAD];
+    const size_t messages = MESSAGES / (producers ? producers : 1);
+
+    (void) unused;
+    for (size_t i = 0; i < messages; i += batch) {
+        if (producers)
+            mpsc_ring_push_wait(&mpsc, buf, batch);
+        else
+            spsc_ring_push_wait(&spsc, buf, batch);
+    }
+    return NULL;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* producers is 0 for spsc_ring_t, or the number of threads pushing to an
+ * mpsc_ring_t.
+ */
+static void bench(unsigned int p, size_t size, size_t b)
+{
+    static char buf[MAXBATCH * MAXPAYLOAD];
+    pthread_t threads[PRODUCERS];
+    const unsigned int nthreads = p ? p : 1;
+
+    producers = p;
+    batch = b;
+    if (p)
+        mpsc_ring_init(&mpsc, CAPACITY, size, RING_BLOCKING);
+    else
+        spsc_ring_init(&spsc, CAPACITY, size, RING_BLOCKING);
+
+    const double start = now();
+    for (unsigned int i = 0; i < nthreads; ++i)
+        if (pthread_create(&threads[i], NULL, produce, NULL))
+            abort();
+    for (size_t n = 0; n < MESSAGES / nthreads * nthreads;) {
+        if (p)
+            n += mpsc_ring_pop_wait(&mpsc, buf, batch);
+        else
+            n += spsc_ring_pop_wait(&spsc, buf, batch);
+    }
+    for (unsigned int i = 0; i < nthreads; ++i)
+        pthread_join(threads[i], NULL);
+    const double elapsed = now() - start;
+
+    printf("%s %3zu-byte messages, batches of %2zu: %7.2f M/s\n",
+           p ? "mpsc_ring_t" : "spsc_ring_t", size, b,
+           MESSAGES / nthreads * nthreads / elapsed * 1e-6);
+
+    if (p)
+        mpsc_ring_destroy(&mpsc);
+    else
+        spsc_ring_destroy(&spsc);
+}
+
+int main(void)
+{
+    static const size_t sizes[] = {8, 64, MAXPAYLOAD};
+    static const size_t batches[] = {1, MAXBATCH};
+
+    for (unsigned int s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s)
+        for (unsigned int b = 0; b < sizeof(batches) / sizeof(batches[0]);
+             ++b) {
+            bench(0, sizes[s], batches[b]);
+            bench(PRODUCERS, sizes[s], batches[b]);
+        }
+    return 0;
+}
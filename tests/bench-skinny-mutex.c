@@ -0,0 +1,70 @@
+/* Measure how long a lock and unlock of a contended skinny_mutex takes, at
+ * different thread counts.  Yielding while holding the mutex makes the other
+ * threads find it held, so they go through the fat_mutex.
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "skinny_mutex.h"
+
+#define OPS 200000
+#define MAXTHREADS 64
+
+static skinny_mutex_t mutex = SKINNY_MUTEX_INITIALIZER;
+static bool yield;
+static unsigned int ops;
+static long counter;
+
+static void *run(void *unused)
+{
+    (void) unused;
+    for (unsigned int i = 0; i < ops; ++i) {
+        skinny_mutex_lock(&mutex);
+        counter++;
+        if (yield)
+            sched_yield();
+        skinny_mutex_unlock(&mutex);
+    }
+    return NULL;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void bench(unsigned int count, bool y)
+{
+    pthread_t threads[MAXTHREADS];
+
+    yield = y;
+    ops = OPS / count;
+    const double start = now();
+    for (unsigned int i = 0; i < count; ++i)
+        if (pthread_create(&threads[i], NULL, run, NULL))
+            abort();
+    for (unsigned int i = 0; i < count; ++i)
+        pthread_join(threads[i], NULL);
+    const double elapsed = now() - start;
+
+    printf("%-8s %3u threads: %8.1f ns/op\n", y ? "yield" : "no yield",
+           count, elapsed * 1e9 / (ops * count));
+}
+
+int main(void)
+{
+    static const unsigned int counts[] = {4, 16, 64};
+
+    for (unsigned int c = 0; c < sizeof(counts) / sizeof(counts[0]); ++c) {
+        bench(counts[c], false);
+        bench(counts[c], true);
+    }
+    return 0;
+}
@@ -0,0 +1,77 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "threadtracer.h"
+
+#define REPORT "threadtracer.test-aggregate.csv"
+
+static void work(int n)
+{
+    for (int i = 0; i < n; ++i) {
+        TT_SCOPE("work");
+        /* Spread the durations over a few histogram buckets. */
+        usleep(i % 4 * 100);
+    }
+}
+
+static void *thread(void *arg UNUSED)
+{
+    assert(TT_ENTRY("worker") >= 0);
+    work(50);
+    return NULL;
+}
+
+int main(void)
+{
+    static char buf[4096];
+    pthread_t t;
+
+    assert(!setenv("THREADTRACERAGGREGATE", "1", 1));
+    assert(TT_ENTRY("main") == 0);
+
+    /* The statistics of the threads are merged per tag. */
+    assert(!pthread_create(&t, NULL, thread, NULL));
+    work(100);
+    assert(!pthread_join(t, NULL));
+    for (int i = 0; i < 10; ++i) {
+        TT_BEGIN("other");
+        TT_END("other");
+    }
+    /* Only scopes are aggregated. */
+    assert(TT_INSTANT("mark") < 0);
+
+    assert(tt_report(REPORT) == 2);
+
+    FILE *f = fopen(REPORT, "r");
+    assert(f);
+    assert(fgets(buf, sizeof(buf), f));
+    assert(!strcmp(buf, "tag,count,wall_total_ns,cpu_total_ns,wall_min_ns,"
+                        "wall_p50_ns,wall_p90_ns,wall_p99_ns,wall_max_ns,"
+                        "preempted,voluntary\n"));
+
+    /* Tags are quoted, from the highest total wall time down. */
+    static const char *const tags[] = {"work", "other"};
+    static const long long counts[] = {150, 10};
+    for (int i = 0; i < 2; ++i) {
+        char tag[16];
+        long long count, total, cpu, min, p50, p90, p99, max, pre, vol;
+        assert(fgets(buf, sizeof(buf), f));
+        assert(sscanf(buf,
+                      "\"%15[^\"]\",%lld,%lld,%lld,%lld,%lld,%lld,%lld,%lld,"
+                      "%lld,%lld",
+                      tag, &count, &total, &cpu, &min, &p50, &p90, &p99, &max,
+                      &pre, &vol) == 11);
+        assert(!strcmp(tag, tags[i]));
+        assert(count == counts[i]);
+        assert(0 <= min && min <= p50 && p50 <= p90 && p90 <= p99 &&
+               p99 <= max && max <= total);
+    }
+    assert(!fgets(buf, sizeof(buf), f));
+    fclose(f);
+    unlink(REPORT);
+    return 0;
+}
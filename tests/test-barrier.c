@@ -0,0 +1,114 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "barrier.h"
+
+#define ROUNDS 200
+#define MAXTHREADS 40
+
+/* Threads go through the rounds in lock step, each recording the round it
+ * is in, and checking that the others are in it too.
+ */
+struct test_rounds {
+    barrier_t barrier;
+    tree_barrier_t tree;
+    bool use_tree;
+    unsigned int count;
+    _Atomic int rounds[MAXTHREADS];
+    _Atomic int serial;
+};
+
+struct test_thread {
+    struct test_rounds *tr;
+    unsigned int index;
+};
+
+static void sync_up(struct test_rounds *tr, unsigned int index)
+{
+    int res = tr->use_tree ? tree_barrier_wait(&tr->tree, index)
+                           : barrier_wait(&tr->barrier);
+    assert(res == 0 || res == BARRIER_SERIAL_THREAD);
+    if (res == BARRIER_SERIAL_THREAD)
+        tr->serial++;
+}
+
+static void *run_rounds(void *v_tt)
+{
+    struct test_thread *tt = v_tt;
+    struct test_rounds *tr = tt->tr;
+
+    for (int round = 0; round < ROUNDS; ++round) {
+        tr->rounds[tt->index] = round;
+        sync_up(tr, tt->index);
+        for (unsigned int i = 0; i < tr->count; ++i)
+            assert(tr->rounds[i] == round);
+        sync_up(tr, tt->index);
+    }
+    return NULL;
+}
+
+static void test_rounds(unsigned int count, bool use_tree)
+{
+    static struct test_rounds tr;
+    struct test_thread tts[MAXTHREADS];
+    pthread_t threads[MAXTHREADS];
+
+    tr.use_tree = use_tree;
+    tr.count = count;
+    tr.serial = 0;
+    if (use_tree)
+        assert(!tree_barrier_init(&tr.tree, count));
+    else
+        assert(!barrier_init(&tr.barrier, count));
+
+    for (unsigned int i = 0; i < count; ++i) {
+        tts[i].tr = &tr;
+        tts[i].index = i;
+        assert(!pthread_create(&threads[i], NULL, run_rounds, &tts[i]));
+    }
+    for (unsigned int i = 0; i < count; ++i)
+        assert(!pthread_join(threads[i], NULL));
+
+    assert(tr.serial == ROUNDS * 2);
+    if (use_tree)
+        assert(!tree_barrier_destroy(&tr.tree));
+    else
+        assert(!barrier_destroy(&tr.barrier));
+}
+
+static void *count_down(void *v_latch)
+{
+    latch_count_down(v_latch, 1);
+    return NULL;
+}
+
+static void test_latch(void)
+{
+    latch_t latch;
+    pthread_t threads[4];
+
+    assert(!latch_init(&latch, 5));
+    assert(!latch_try_wait(&latch));
+    for (int i = 0; i < 4; ++i)
+        assert(!pthread_create(&threads[i], NULL, count_down, &latch));
+    latch_arrive_and_wait(&latch, 1);
+    assert(latch_try_wait(&latch));
+    for (int i = 0; i < 4; ++i)
+        assert(!pthread_join(threads[i], NULL));
+
+    /* Once open, it stays open. */
+    latch_wait(&latch);
+    assert(!latch_destroy(&latch));
+}
+
+int main(void)
+{
+    test_rounds(1, false);
+    test_rounds(4, false);
+    test_rounds(1, true);
+    test_rounds(5, true);
+    test_rounds(MAXTHREADS, true);
+    test_latch();
+    return 0;
+}
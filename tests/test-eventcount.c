@@ -0,0 +1,70 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+
+#include "thread.h"
+
+#define CONSUMERS 4
+#define ITEMS 100000
+
+/* A stand-in for a lock-free queue: a count of items, and a flag to say that
+ * no more are coming.
+ */
+static struct eventcount ec;
+static _Atomic int items;
+static _Atomic bool done;
+static _Atomic int consumed;
+
+static bool try_pop(void)
+{
+    int n = atomic_load(&items);
+    while (n > 0)
+        if (atomic_compare_exchange_weak(&items, &n, n - 1))
+            return true;
+    return false;
+}
+
+static void *consume(void *unused)
+{
+    (void) unused;
+    for (;;) {
+        if (try_pop()) {
+            consumed++;
+            continue;
+        }
+        if (done)
+            return NULL;
+        unsigned int key = eventcount_prepare_wait(&ec);
+        if (atomic_load(&items) > 0 || done) {
+            eventcount_cancel_wait(&ec);
+            continue;
+        }
+        eventcount_commit_wait(&ec, key);
+    }
+}
+
+int main(void)
+{
+    pthread_t threads[CONSUMERS];
+
+    eventcount_init(&ec);
+
+    /* Nobody waits, so this does nothing. */
+    eventcount_notify(&ec);
+
+    for (int i = 0; i < CONSUMERS; ++i)
+        assert(!pthread_create(&threads[i], NULL, consume, NULL));
+    for (int i = 0; i < ITEMS; ++i) {
+        items++;
+        eventcount_notify(&ec);
+    }
+    done = true;
+    eventcount_notify_all(&ec);
+    for (int i = 0; i < CONSUMERS; ++i)
+        assert(!pthread_join(threads[i], NULL));
+
+    assert(consumed == ITEMS);
+    eventcount_fini(&ec);
+    return 0;
+}
@@ -0,0 +1,71 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "threadtracer.h"
+
+#define REPORT "threadtracer.test-filters.json"
+
+static int count(const char *haystack, const char *needle)
+{
+    int n = 0;
+    for (const char *p = haystack; (p = strstr(p, needle)); p += strlen(needle))
+        n++;
+    return n;
+}
+
+int main(void)
+{
+    static char buf[64 * 1024];
+
+    /* The filters are read when the first thread signs in. */
+    assert(!setenv("THREADTRACERCATEGORIES", "-noisy", 1));
+    assert(!setenv("THREADTRACERSAMPLE", "sampled=10", 1));
+    assert(!setenv("THREADTRACERMINDURATION", "1000", 1));
+    assert(TT_ENTRY("main") == 0);
+
+    /* A category that is turned off. */
+    assert(TT_BEGIN_CAT("noisy", "noise") < 0);
+    assert(TT_END_CAT("noisy", "noise") < 0);
+
+    /* 1 in 10 scopes of a sampled tag, the 1st and the 11th. */
+    for (int i = 0; i < 20; ++i) {
+        TT_BEGIN("sampled");
+        usleep(2000);
+        TT_END("sampled");
+    }
+
+    /* A short scope nested in a long one is dropped, and its "B" sample is
+     * reclaimed.
+     */
+    TT_BEGIN("outer");
+    usleep(2000);
+    TT_BEGIN("inner");
+    assert(TT_END("inner") < 0);
+    TT_END("outer");
+
+    /* A short scope with an event inside is dropped, but not the event. */
+    TT_BEGIN("brief");
+    TT_INSTANT("mark");
+    assert(TT_END("brief") < 0);
+
+    assert(tt_report(REPORT) == 7);
+
+    FILE *f = fopen(REPORT, "r");
+    assert(f);
+    size_t n = fread(buf, 1, sizeof(buf) - 1, f);
+    buf[n] = '\0';
+    fclose(f);
+    unlink(REPORT);
+
+    assert(!strstr(buf, "noise"));
+    assert(count(buf, "\"name\":\"sampled\"") == 4);
+    assert(strstr(buf, "\"ph\":\"B\",\"name\":\"outer\""));
+    assert(strstr(buf, "\"ph\":\"E\",\"name\":\"outer\""));
+    assert(!strstr(buf, "inner"));
+    assert(!strstr(buf, "brief"));
+    assert(strstr(buf, "\"name\":\"mark\""));
+    return 0;
+}
@@ -0,0 +1,75 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "hashmap.h"
+
+#define THREADS 4
+#define KEYS 20000
+
+static hashmap_t map;
+
+static void *key(uintptr_t k)
+{
+    return (void *) (k + 1);
+}
+
+static void *value(uintptr_t k)
+{
+    return (void *) (k * 3 + 1);
+}
+
+/* Each thread adds, replaces and removes keys of its own, while looking up
+ * those of the others, through several resizes.
+ */
+static void *worker(void *v_index)
+{
+    const uintptr_t base = (uintptr_t) v_index * KEYS;
+
+    for (uintptr_t k = base; k < base + KEYS; ++k) {
+        assert(!hashmap_put(&map, key(k), value(k)));
+        assert(hashmap_get(&map, key(k)) == value(k));
+        void *other = hashmap_get(&map, key((k + KEYS) % (THREADS * KEYS)));
+        assert(!other || other == value((k + KEYS) % (THREADS * KEYS)));
+    }
+
+    /* Remove every other key, and check the rest survived. */
+    for (uintptr_t k = base; k < base + KEYS; k += 2)
+        assert(hashmap_remove(&map, key(k)) == value(k));
+    for (uintptr_t k = base; k < base + KEYS; ++k)
+        assert(hashmap_get(&map, key(k)) == (k % 2 ? value(k) : NULL));
+    return NULL;
+}
+
+int main(void)
+{
+    pthread_t threads[THREADS];
+
+    assert(!hashmap_init(&map, NULL, NULL));
+    assert(!hashmap_get(&map, key(0)));
+    assert(!hashmap_remove(&map, key(0)));
+
+    /* Enough keys for the map to grow a few times. */
+    for (uintptr_t k = 0; k < 1000; ++k)
+        assert(!hashmap_put(&map, key(k), value(k)));
+    assert(hashmap_count(&map) == 1000);
+    assert(!hashmap_put(&map, key(7), value(8)));
+    assert(hashmap_count(&map) == 1000);
+    for (uintptr_t k = 0; k < 1000; ++k)
+        assert(hashmap_get(&map, key(k)) == (k == 7 ? value(8) : value(k)));
+    for (uintptr_t k = 0; k < 1000; ++k)
+        assert(hashmap_remove(&map, key(k)));
+    assert(hashmap_count(&map) == 0);
+    assert(!hashmap_get(&map, key(7)));
+
+    for (uintptr_t i = 0; i < THREADS; ++i)
+        assert(!pthread_create(&threads[i], NULL, worker, (void *) i));
+    for (int i = 0; i < THREADS; ++i)
+        assert(!pthread_join(threads[i], NULL));
+    assert(hashmap_count(&map) == THREADS * KEYS / 2);
+    printf("%zu keys\n", hashmap_count(&map));
+
+    hashmap_destroy(&map);
+    return 0;
+}
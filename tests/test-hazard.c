@@ -0,0 +1,82 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+
+#include "barrier.h"
+#include "hazard.h"
+
+#define READERS 3
+#define SWAPS 20000
+#define MAGIC 0x5afe
+
+struct obj {
+    int magic;
+};
+
+static void *shared;
+static atomic_int freed;
+static atomic_bool swapping = true;
+static barrier_t finished;
+
+static struct obj *obj_new(void)
+{
+    struct obj *obj = malloc(sizeof(*obj));
+    assert(obj);
+    obj->magic = MAGIC;
+    return obj;
+}
+
+static void obj_free(void *v_obj)
+{
+    struct obj *obj = v_obj;
+    obj->magic = 0;
+    free(obj);
+    freed++;
+}
+
+/* The object a reader protects is never freed under it. */
+static void *reader(void *unused)
+{
+    (void) unused;
+    while (swapping) {
+        struct obj *obj = hazard_protect(0, &shared);
+        assert(obj->magic == MAGIC);
+        hazard_clear(0);
+    }
+    barrier_wait(&finished);
+    return NULL;
+}
+
+/* Retired objects are all freed once nobody protects them. */
+static void *writer(void *unused)
+{
+    (void) unused;
+    for (int i = 0; i < SWAPS; ++i) {
+        struct obj *old = __atomic_exchange_n(&shared, obj_new(),
+                                              __ATOMIC_SEQ_CST);
+        hazard_retire(old, obj_free);
+    }
+    swapping = false;
+    barrier_wait(&finished);
+    hazard_scan();
+    assert(freed == SWAPS);
+    return NULL;
+}
+
+int main(void)
+{
+    pthread_t threads[READERS + 1];
+
+    shared = obj_new();
+    assert(!barrier_init(&finished, READERS + 1));
+    for (int i = 0; i < READERS; ++i)
+        assert(!pthread_create(&threads[i], NULL, reader, NULL));
+    assert(!pthread_create(&threads[READERS], NULL, writer, NULL));
+    for (int i = 0; i <= READERS; ++i)
+        assert(!pthread_join(threads[i], NULL));
+
+    obj_free(shared);
+    assert(!barrier_destroy(&finished));
+    return 0;
+}
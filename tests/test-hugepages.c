@@ -0,0 +1,53 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "threadtracer.h"
+
+#define REPORT "threadtracer.test-hugepages.json"
+#define LOG "threadtracer.test-hugepages.log"
+
+/* MAXSAMPLES in threadtracer.c, the samples a thread can record. */
+#define MAXSAMPLES (64 * 1024)
+
+int main(void)
+{
+    char line[256];
+    int total, discarded;
+
+    /* The buffers for the samples and their waits, rounded up to huge
+     * pages or not, must hold all the samples a thread can record.
+     */
+    assert(!setenv("THREADTRACERHUGEPAGES", "1", 1));
+    assert(!setenv("THREADTRACEROFFCPU", "100", 1));
+    assert(TT_ENTRY("main") == 0);
+
+    /* An "E" without a "B", which the report discards. */
+    assert(TT_END("stray") == 0);
+
+    /* Fill the buffers, until recording stops. */
+    int recorded = 1;
+    while (TT_BEGIN("fill") >= 0) {
+        recorded++;
+        if (TT_END("fill") >= 0)
+            recorded++;
+    }
+    assert(recorded == MAXSAMPLES);
+    assert(TT_INSTANT("too late") < 0);
+
+    /* All but the stray "E" are written; the last "B" stays open. */
+    assert(freopen(LOG, "w", stderr));
+    assert(tt_report(REPORT) == MAXSAMPLES - 1);
+    fflush(stderr);
+    FILE *f = fopen(LOG, "r");
+    assert(f && fgets(line, sizeof(line), f));
+    fclose(f);
+    assert(sscanf(line, "ThreadTracer: Wrote %d events (%d discarded)", &total,
+                  &discarded) == 2);
+    assert(total == MAXSAMPLES - 1 && discarded == 1);
+    unlink(LOG);
+    unlink(REPORT);
+    return 0;
+}
@@ -0,0 +1,75 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "threadtracer.h"
+
+/* Trace a scope named 'tag' in a child process, which reports to a file named
+ * after its pid.  Returns the pid.
+ */
+static pid_t trace_child(const char *tag)
+{
+    char name[64];
+    int status;
+
+    pid_t pid = fork();
+    assert(pid >= 0);
+    if (!pid) {
+        snprintf(name, sizeof(name), "threadtracer.%d.json", (int) getpid());
+        TT_ENTRY(tag);
+        TT_BEGIN(tag);
+        usleep(1000);
+        TT_END(tag);
+        _exit(tt_report(name) != 2);
+    }
+    assert(waitpid(pid, &status, 0) == pid);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    return pid;
+}
+
+/* The "ts" of the first event named 'tag' in 's'. */
+static long long find_ts(const char *s, const char *tag)
+{
+    char key[64];
+    snprintf(key, sizeof(key), "\"name\":\"%s\"", tag);
+    const char *p = strstr(s, key);
+    assert(p);
+    while (p > s && strncmp(p, "\"ts\":", 5))
+        p--;
+    return strtoll(p + 5, NULL, 10);
+}
+
+int main(void)
+{
+    char cmd[256], buf[4096];
+
+    /* Each process starts its timeline at 0, as the second process only
+     * starts once the first has finished.
+     */
+    pid_t first = trace_child("first");
+    pid_t second = trace_child("second");
+
+    /* The same report twice has a pid clash. */
+    snprintf(cmd, sizeof(cmd),
+             "tools/threadtracer-merge threadtracer.merged.json "
+             "threadtracer.%d.json threadtracer.%d.json threadtracer.%d.json",
+             (int) second, (int) first, (int) first);
+    assert(system(cmd) == 0);
+
+    FILE *f = fopen("threadtracer.merged.json", "r");
+    assert(f);
+    size_t n = fread(buf, 1, sizeof(buf) - 1, f);
+    buf[n] = '\0';
+    fclose(f);
+
+    /* On the merged timeline, the second process comes after the first. */
+    assert(find_ts(buf, "second") > find_ts(buf, "first") + 1000);
+    snprintf(cmd, sizeof(cmd), "\"pid\":%d,", (int) first);
+    assert(strstr(buf, cmd));
+    snprintf(cmd, sizeof(cmd), "\"pid\":%d,", (int) second);
+    assert(strstr(buf, cmd));
+    return 0;
+}
@@ -0,0 +1,68 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "thread.h"
+
+static struct mutex contended;
+
+static void *hold(void *unused)
+{
+    (void) unused;
+    mutex_lock(&contended);
+    usleep(10000);
+    mutex_unlock(&contended);
+    return NULL;
+}
+
+int main(void)
+{
+    struct mutex m[2];
+    pthread_t thread;
+    char *dump;
+    size_t len;
+
+    /* Both mutexes come from one call site, so they add up. */
+    for (int i = 0; i < 2; ++i)
+        mutex_init(&m[i]);
+    for (int i = 0; i < 3; ++i) {
+        mutex_lock(&m[i % 2]);
+        mutex_unlock(&m[i % 2]);
+    }
+
+    /* Waits for the thread to release it. */
+    mutex_init(&contended);
+    mutex_lock(&contended);
+    assert(!pthread_create(&thread, NULL, hold, NULL));
+    mutex_unlock(&contended);
+    usleep(1000);
+    mutex_lock(&contended);
+    mutex_unlock(&contended);
+    assert(!pthread_join(thread, NULL));
+
+    FILE *out = open_memstream(&dump, &len);
+    assert(out);
+    mutex_stats_dump(out);
+    fclose(out);
+    fputs(dump, stdout);
+    assert(strstr(dump, "tests/test-mutex-stats.c:30: 3 locks\n"));
+    assert(strstr(dump, "tests/test-mutex-stats.c:37: 3 locks\n"));
+    assert(strstr(dump, "    wait < 2^"));
+    free(dump);
+
+    mutex_stats_reset();
+    out = open_memstream(&dump, &len);
+    assert(out);
+    mutex_stats_dump(out);
+    fclose(out);
+    assert(strstr(dump, ":30: 0 locks\n"));
+    free(dump);
+
+    for (int i = 0; i < 2; ++i)
+        mutex_fini(&m[i]);
+    mutex_fini(&contended);
+    return 0;
+}
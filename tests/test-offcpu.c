@@ -0,0 +1,57 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "skinny_mutex.h"
+#include "threadtracer.h"
+
+#define REPORT "threadtracer.test-offcpu.json"
+
+static skinny_mutex_t mutex = SKINNY_MUTEX_INITIALIZER;
+
+static void *contender(void *arg UNUSED)
+{
+    assert(TT_ENTRY("contender") >= 0);
+    TT_BEGIN("contended");
+    assert(!skinny_mutex_lock(&mutex));
+    assert(!skinny_mutex_unlock(&mutex));
+    TT_END("contended");
+    return NULL;
+}
+
+int main(void)
+{
+    static char buf[4096];
+    pthread_t thread;
+
+    assert(!setenv("THREADTRACEROFFCPU", "100", 1));
+    assert(TT_ENTRY("main") == 0);
+
+    /* Hold the mutex long enough for the other thread to sleep on it. */
+    assert(!skinny_mutex_lock(&mutex));
+    assert(!pthread_create(&thread, NULL, contender, NULL));
+    usleep(50000);
+    assert(!skinny_mutex_unlock(&mutex));
+    assert(!pthread_join(thread, NULL));
+    assert(tt_report(REPORT) == 2);
+
+    FILE *f = fopen(REPORT, "r");
+    assert(f);
+    size_t n = fread(buf, 1, sizeof(buf) - 1, f);
+    buf[n] = '\0';
+    fclose(f);
+    unlink(REPORT);
+
+    /* The wait shows up in the args of the "E" of the scope. */
+    const char *end = strstr(buf, "\"ph\":\"E\",\"name\":\"contended\"");
+    assert(end);
+    const char *arg = strstr(end, "\"wait_mutex(us)\":");
+    assert(arg);
+    const long waited = atol(arg + strlen("\"wait_mutex(us)\":"));
+    assert(waited > 0 && waited <= 1000000);
+    assert(strstr(end, "\"wait_condvar(us)\":0,"));
+    return 0;
+}
@@ -0,0 +1,38 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+
+#include "percpu.h"
+
+#define THREADS 8
+#define ADDS 1000000
+
+static percpu_counter_t counter;
+
+static void *add(void *unused)
+{
+    (void) unused;
+    for (int i = 0; i < ADDS; ++i)
+        percpu_counter_add(&counter, i % 2 ? 3 : -1);
+    return NULL;
+}
+
+int main(void)
+{
+    pthread_t threads[THREADS];
+
+    assert(!percpu_counter_init(&counter));
+    assert(percpu_counter_read(&counter) == 0);
+    printf("%u per-CPU slots, %s\n", percpu_slots,
+           percpu_rseq_slots ? "using rseq" : "without rseq");
+
+    /* No update is lost, even when preempted in the middle of one. */
+    for (int i = 0; i < THREADS; ++i)
+        assert(!pthread_create(&threads[i], NULL, add, NULL));
+    for (int i = 0; i < THREADS; ++i)
+        assert(!pthread_join(threads[i], NULL));
+    assert(percpu_counter_read(&counter) == (int64_t) THREADS * ADDS);
+
+    percpu_counter_destroy(&counter);
+    return 0;
+}
@@ -0,0 +1,116 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "threadtracer.h"
+
+#define REPORT "threadtracer.test-perf.json"
+#define COUNTED_REPORT "threadtracer.test-perf-counted.json"
+#define COUNTED_LOG "threadtracer.test-perf-counted.log"
+
+static size_t read_file(const char *name, char *buf, size_t size)
+{
+    FILE *f = fopen(name, "r");
+    assert(f);
+    size_t n = fread(buf, 1, size - 1, f);
+    buf[n] = '\0';
+    fclose(f);
+    unlink(name);
+    return n;
+}
+
+/* The value of the arg 'name' of the event that starts at 'event'. */
+static long long event_arg(const char *event, const char *name)
+{
+    char key[64];
+    snprintf(key, sizeof(key), "\"%s\":", name);
+    const char *end = strstr(event, "}}");
+    const char *p = strstr(event, key);
+    assert(p && end && p < end);
+    return atoll(p + strlen(key));
+}
+
+/* Trace a loop with the counters, in a process of its own, as they are only
+ * set up when the first thread signs in.
+ */
+static void counted(void)
+{
+    volatile unsigned long sum = 0;
+
+    assert(!setenv("THREADTRACERPERF", "1", 1));
+    assert(freopen(COUNTED_LOG, "w", stderr));
+    assert(TT_ENTRY("counted") == 0);
+    {
+        TT_SCOPE("loop");
+        for (unsigned long i = 0; i < 1000000; ++i)
+            sum += i;
+    }
+    assert(tt_report(COUNTED_REPORT) == 2);
+    exit(0);
+}
+
+/* Where the counters can be read, a scope has them as args. */
+static void test_counted(void)
+{
+    static char buf[4096], log[4096];
+    int status;
+
+    pid_t pid = fork();
+    assert(pid >= 0);
+    if (!pid)
+        counted();
+    assert(waitpid(pid, &status, 0) == pid);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    read_file(COUNTED_LOG, log, sizeof(log));
+    read_file(COUNTED_REPORT, buf, sizeof(buf));
+    if (strstr(log, "unavailable")) {
+        printf("Hardware counters unavailable, not checking them.\n");
+        return;
+    }
+
+    const char *event = strstr(buf, "\"ph\":\"E\",\"name\":\"loop\"");
+    assert(event);
+    assert(event_arg(event, "cycles") >= 0);
+    assert(event_arg(event, "instructions") > 0);
+    assert(event_arg(event, "ipc(%)") >= 0);
+}
+
+int main(void)
+{
+    static char buf[4096];
+    struct rlimit old, none;
+
+    test_counted();
+
+    /* Make perf_event_open fail for want of file descriptors, where the
+     * kernel would allow it, so that tracing has to do without counters.
+     */
+    assert(!setenv("THREADTRACERPERF", "1", 1));
+    assert(!getrlimit(RLIMIT_NOFILE, &old));
+    none = old;
+    none.rlim_cur = 3;
+    assert(!setrlimit(RLIMIT_NOFILE, &none));
+    assert(TT_ENTRY("main") == 0);
+    assert(!setrlimit(RLIMIT_NOFILE, &old));
+
+    for (int i = 0; i < 3; ++i) {
+        TT_SCOPE("work");
+        usleep(100);
+    }
+    assert(tt_report(REPORT) == 6);
+
+    size_t n = read_file(REPORT, buf, sizeof(buf));
+
+    assert(strstr(buf, "\"ph\":\"E\",\"name\":\"work\""));
+    assert(strstr(buf, "\"dutycycle(%)\""));
+    assert(!strstr(buf, "cycles\""));
+    assert(!strstr(buf, "instructions"));
+    assert(!strstr(buf, "ipc(%)"));
+    assert(!strcmp(buf + n - 3, "}}\n"));
+    return 0;
+}
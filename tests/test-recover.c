@@ -0,0 +1,65 @@
+#include <assert.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "threadtracer.h"
+
+/* Record some events in trace files, and die without writing a report. */
+static void crash(void)
+{
+    assert(!setenv("THREADTRACERMMAP", ".", 1));
+    assert(!setenv("THREADTRACEROFFCPU", "100", 1));
+    assert(TT_ENTRY("crasher") == 0);
+    TT_BEGIN("outer");
+    TT_BEGIN("inner");
+    TT_WAIT_BEGIN(TT_WAIT_IO);
+    usleep(20000);
+    TT_WAIT_END();
+    TT_END("inner");
+    TT_COUNTER("counter", 42);
+    TT_BEGIN("unfinished");
+    raise(SIGKILL);
+}
+
+int main(void)
+{
+    char cmd[256], buf[4096];
+    int status;
+
+    pid_t pid = fork();
+    assert(pid >= 0);
+    if (!pid)
+        crash();
+    assert(waitpid(pid, &status, 0) == pid);
+    assert(WIFSIGNALED(status) && WTERMSIG(status) == SIGKILL);
+
+    /* The 5 events and the thread name can be recovered. */
+    snprintf(cmd, sizeof(cmd),
+             "tools/threadtracer-recover threadtracer.%d.json "
+             "threadtracer.%d.0.trace",
+             (int) pid, (int) pid);
+    assert(system(cmd) == 0);
+
+    snprintf(cmd, sizeof(cmd), "threadtracer.%d.json", (int) pid);
+    FILE *f = fopen(cmd, "r");
+    assert(f);
+    size_t n = fread(buf, 1, sizeof(buf) - 1, f);
+    buf[n] = '\0';
+    fclose(f);
+    assert(strstr(buf, "\"ph\":\"E\",\"name\":\"inner\""));
+    /* So can the off-CPU breakdown of the scope that waited. */
+    const char *wait = strstr(buf, "\"wait_io(us)\":");
+    assert(wait && atoi(wait + strlen("\"wait_io(us)\":")) >= 10000);
+    assert(strstr(wait, "\"wait_other(us)\":"));
+    assert(strstr(buf, "\"name\":\"counter\",\"args\":{\"value\":42}"));
+    assert(strstr(buf, "\"ph\":\"B\",\"name\":\"unfinished\""));
+    assert(strstr(buf, "\"name\" : \"crasher\""));
+
+    snprintf(cmd, sizeof(cmd), "threadtracer.%d.0.trace", (int) pid);
+    unlink(cmd);
+    return 0;
+}
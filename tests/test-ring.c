@@ -0,0 +1,118 @@
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+
+#include "ring.h"
+
+#define PRODUCERS 4
+#define MESSAGES 200000
+#define BATCH 7
+
+static spsc_ring_t spsc;
+static mpsc_ring_t mpsc;
+
+/* Push MESSAGES sequence numbers, in batches of different sizes. */
+static void *spsc_producer(void *unused)
+{
+    uint64_t buf[BATCH];
+
+    (void) unused;
+    for (uint64_t i = 0; i < MESSAGES;) {
+        size_t n = i % BATCH + 1;
+        if (n > MESSAGES - i)
+            n = MESSAGES - i;
+        for (size_t j = 0; j < n; ++j)
+            buf[j] = i + j;
+        spsc_ring_push_wait(&spsc, buf, n);
+        i += n;
+    }
+    return NULL;
+}
+
+/* Push MESSAGES of (producer, sequence number). */
+static void *mpsc_producer(void *v_index)
+{
+    uint64_t buf[BATCH];
+
+    for (uint64_t i = 0; i < MESSAGES;) {
+        size_t n = i % BATCH + 1;
+        if (n > MESSAGES - i)
+            n = MESSAGES - i;
+        for (size_t j = 0; j < n; ++j)
+            buf[j] = (uintptr_t) v_index << 32 | (i + j);
+        mpsc_ring_push_wait(&mpsc, buf, n);
+        i += n;
+    }
+    return NULL;
+}
+
+int main(void)
+{
+    pthread_t threads[PRODUCERS];
+    uint64_t buf[BATCH];
+
+    assert(spsc_ring_init(&spsc, 0, 8, 0) == EINVAL);
+
+    /* Fill and drain a ring a few times round, without blocking. */
+    assert(!spsc_ring_init(&spsc, 5, sizeof(uint64_t), 0));
+    uint64_t in = 0, out = 0;
+    for (int round = 0; round < 10; ++round) {
+        for (size_t j = 0; j < BATCH; ++j)
+            buf[j] = in + j;
+        const size_t room = 8 - (in - out);
+        size_t n = spsc_ring_push(&spsc, buf, BATCH);
+        assert(n == (room < BATCH ? room : BATCH));
+        in += n;
+        if (in - out == 8)
+            assert(!spsc_ring_push(&spsc, buf, 1));
+        n = spsc_ring_pop(&spsc, buf, round % 3 + 3);
+        for (size_t j = 0; j < n; ++j)
+            assert(buf[j] == out + j);
+        out += n;
+    }
+    spsc_ring_destroy(&spsc);
+
+    /* A producer thread and a consumer pass messages through a small ring,
+     * so that each has to wait for the other.
+     */
+    assert(!spsc_ring_init(&spsc, 16, sizeof(uint64_t), RING_BLOCKING));
+    assert(!pthread_create(&threads[0], NULL, spsc_producer, NULL));
+    for (uint64_t i = 0; i < MESSAGES;) {
+        size_t n = spsc_ring_pop_wait(&spsc, buf, BATCH);
+        for (size_t j = 0; j < n; ++j)
+            assert(buf[j] == i + j);
+        i += n;
+    }
+    assert(!pthread_join(threads[0], NULL));
+    assert(!spsc_ring_pop(&spsc, buf, 1));
+    spsc_ring_destroy(&spsc);
+
+    /* With several producers, each one's messages arrive in order, and
+     * batches are not split up.
+     */
+    assert(!mpsc_ring_init(&mpsc, 16, sizeof(uint64_t), RING_BLOCKING));
+    uint64_t fill[17] = {0};
+    assert(!mpsc_ring_push(&mpsc, fill, 17));
+    assert(mpsc_ring_push(&mpsc, fill, 16));
+    assert(!mpsc_ring_push(&mpsc, fill, 1));
+    assert(mpsc_ring_pop(&mpsc, fill, 17) == 16);
+
+    uint64_t next[PRODUCERS] = {0};
+    for (uintptr_t i = 0; i < PRODUCERS; ++i)
+        assert(!pthread_create(&threads[i], NULL, mpsc_producer, (void *) i));
+    for (uint64_t total = 0; total < PRODUCERS * MESSAGES;) {
+        size_t n = mpsc_ring_pop_wait(&mpsc, buf, BATCH);
+        for (size_t j = 0; j < n; ++j) {
+            const unsigned int p = buf[j] >> 32;
+            assert(p < PRODUCERS);
+            assert((uint32_t) buf[j] == next[p]);
+            next[p]++;
+        }
+        total += n;
+    }
+    for (int i = 0; i < PRODUCERS; ++i)
+        assert(!pthread_join(threads[i], NULL));
+    mpsc_ring_destroy(&mpsc);
+    return 0;
+}
@@ -0,0 +1,99 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include "skinny_sem.h"
+
+#define ITEMS 100000
+#define CONSUMERS 4
+
+/* A deadline 'ms' milliseconds from now. */
+static struct timespec deadline(long ms)
+{
+    struct timespec ts;
+    assert(!clock_gettime(CLOCK_REALTIME, &ts));
+    ts.tv_nsec += ms * 1000000;
+    ts.tv_sec += ts.tv_nsec / 1000000000;
+    ts.tv_nsec %= 1000000000;
+    return ts;
+}
+
+static void test_sem_basics(void)
+{
+    skinny_sem_t sem = SKINNY_SEM_INITIALIZER(1);
+    unsigned int value;
+
+    assert(!skinny_sem_trywait(&sem));
+    assert(skinny_sem_trywait(&sem) == EAGAIN);
+    struct timespec ts = deadline(10);
+    assert(skinny_sem_timedwait(&sem, &ts) == ETIMEDOUT);
+    assert(!skinny_sem_post(&sem));
+    assert(!skinny_sem_post(&sem));
+    assert(!skinny_sem_getvalue(&sem, &value) && value == 2);
+    assert(!skinny_sem_wait(&sem));
+    assert(!skinny_sem_wait(&sem));
+    assert(!skinny_sem_destroy(&sem));
+}
+
+static skinny_sem_t items;
+
+static void *consume(void *unused)
+{
+    (void) unused;
+    for (int i = 0; i < ITEMS / CONSUMERS; ++i)
+        assert(!skinny_sem_wait(&items));
+    return NULL;
+}
+
+static void test_sem_contention(void)
+{
+    pthread_t threads[CONSUMERS];
+    unsigned int value;
+
+    assert(!skinny_sem_init(&items, 0));
+    for (int i = 0; i < CONSUMERS; ++i)
+        assert(!pthread_create(&threads[i], NULL, consume, NULL));
+    for (int i = 0; i < ITEMS; ++i)
+        assert(!skinny_sem_post(&items));
+    for (int i = 0; i < CONSUMERS; ++i)
+        assert(!pthread_join(threads[i], NULL));
+    assert(!skinny_sem_getvalue(&items, &value) && value == 0);
+    assert(!skinny_sem_destroy(&items));
+}
+
+static skinny_event_t event = SKINNY_EVENT_INITIALIZER;
+
+static void *wait_event(void *unused)
+{
+    (void) unused;
+    assert(!skinny_event_wait(&event));
+    assert(skinny_event_is_set(&event));
+    return NULL;
+}
+
+static void test_event(void)
+{
+    pthread_t threads[CONSUMERS];
+
+    struct timespec ts = deadline(10);
+    assert(skinny_event_timedwait(&event, &ts) == ETIMEDOUT);
+    for (int i = 0; i < CONSUMERS; ++i)
+        assert(!pthread_create(&threads[i], NULL, wait_event, NULL));
+    assert(!skinny_event_set(&event));
+    for (int i = 0; i < CONSUMERS; ++i)
+        assert(!pthread_join(threads[i], NULL));
+
+    /* Once set, it stays set. */
+    assert(!skinny_event_set(&event));
+    assert(!skinny_event_wait(&event));
+    assert(!skinny_event_destroy(&event));
+}
+
+int main(void)
+{
+    test_sem_basics();
+    test_sem_contention();
+    test_event();
+    return 0;
+}
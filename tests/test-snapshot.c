@@ -0,0 +1,101 @@
+#include <assert.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "threadtracer.h"
+
+#define CONTROL "threadtracer.test-snapshot.control"
+
+static atomic_bool stopping;
+static atomic_int ticks;
+
+static void *worker(void *arg UNUSED)
+{
+    assert(TT_ENTRY("worker") >= 0);
+    while (!atomic_load(&stopping)) {
+        TT_BEGIN("tick");
+        usleep(1000);
+        TT_END("tick");
+        atomic_fetch_add(&ticks, 1);
+    }
+    return NULL;
+}
+
+static void wait_ticks(int n)
+{
+    while (atomic_load(&ticks) < n)
+        usleep(1000);
+}
+
+static int count(const char *haystack, const char *needle)
+{
+    int n = 0;
+    for (const char *p = haystack; (p = strstr(p, needle)); p += strlen(needle))
+        n++;
+    return n;
+}
+
+/* Wait for the dumper thread to write snapshot 'index' in full, and return
+ * how many "tick" events it holds.
+ */
+static int wait_snapshot(int index)
+{
+    static char buf[256 * 1024];
+    char name[64];
+
+    snprintf(name, sizeof(name), "threadtracer.%ld.%d.json", (long) getpid(),
+             index);
+    for (int tries = 0; tries < 10000; ++tries, usleep(1000)) {
+        FILE *f = fopen(name, "r");
+        if (!f)
+            continue;
+        size_t n = fread(buf, 1, sizeof(buf) - 1, f);
+        buf[n] = '\0';
+        fclose(f);
+        if (n < 3 || strcmp(buf + n - 3, "}}\n"))
+            continue;
+        unlink(name);
+        return count(buf, "\"name\":\"tick\"");
+    }
+    assert(!"snapshot written");
+    return 0;
+}
+
+int main(void)
+{
+    pthread_t thread;
+
+    assert(!setenv("THREADTRACERSIGNAL", "SIGUSR2", 1));
+    assert(!setenv("THREADTRACERCONTROL", CONTROL, 1));
+    unlink(CONTROL);
+    assert(TT_ENTRY("main") == 0);
+    assert(!pthread_create(&thread, NULL, worker, NULL));
+
+    /* A snapshot on the signal, while the worker is tracing. */
+    wait_ticks(10);
+    assert(!raise(SIGUSR2));
+    const int first = wait_snapshot(0);
+    assert(first >= 20);
+
+    /* Tracing carries on, and the next snapshot, when the control file is
+     * created, has more events.
+     */
+    wait_ticks(atomic_load(&ticks) + 10);
+    FILE *f = fopen(CONTROL, "w");
+    assert(f);
+    fclose(f);
+    const int second = wait_snapshot(1);
+    assert(second > first);
+    assert(access(CONTROL, F_OK) < 0);
+    assert(TT_INSTANT("still recording") >= 0);
+
+    atomic_store(&stopping, true);
+    assert(!pthread_join(thread, NULL));
+    return 0;
+}
@@ -0,0 +1,113 @@
+#include <assert.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hazard.h"
+#include "thread.h"
+
+TLS_VAR_DECLARE_STATIC(tls_value);
+
+/* How many functions each thread has run. */
+static __thread int runs;
+
+static int resets;
+static int freed;
+static pthread_t first_thread;
+
+static void reset_value(void)
+{
+    TLS_VAR_SET(tls_value, NULL);
+    resets++;
+}
+
+static void obj_free(void *obj)
+{
+    free(obj);
+    freed++;
+}
+
+/* Change everything about the thread that should not leak into the next
+ * function, and retire an object, which it is too early to free.
+ */
+static void first(void *unused)
+{
+    (void) unused;
+    sigset_t set;
+
+    first_thread = pthread_self();
+    runs++;
+    TLS_VAR_SET(tls_value, &runs);
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    assert(!pthread_sigmask(SIG_BLOCK, &set, NULL));
+    assert(!pthread_setname_np(pthread_self(), "first"));
+    assert(!pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL));
+
+    hazard_retire(malloc(1), obj_free);
+    assert(!freed);
+}
+
+/* Runs on the thread that ran first(), which looks like a new thread. */
+static void second(void *unused)
+{
+    (void) unused;
+    sigset_t set;
+    char name[16];
+    int state;
+
+    assert(pthread_equal(pthread_self(), first_thread));
+    assert(++runs == 2);
+    assert(resets == 1);
+    assert(!TLS_VAR_GET(tls_value));
+
+    assert(!pthread_sigmask(SIG_BLOCK, NULL, &set));
+    assert(!sigismember(&set, SIGUSR1));
+    assert(!pthread_getname_np(pthread_self(), name, sizeof(name)));
+    assert(strcmp(name, "first"));
+    assert(!pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, &state));
+    assert(state == PTHREAD_CANCEL_ENABLE);
+}
+
+static void exiting(void *unused)
+{
+    (void) unused;
+    runs++;
+    pthread_exit(NULL);
+}
+
+/* Runs on a new thread, as the one that called pthread_exit is gone. */
+static void after_exit(void *unused)
+{
+    (void) unused;
+    assert(++runs == 1);
+}
+
+int main(void)
+{
+    struct thread thr;
+
+    thread_on_reuse(reset_value);
+
+    thread_init(&thr, first, NULL);
+    thread_fini(&thr);
+    /* The thread gave back its hazard record while parked. */
+    assert(resets == 1);
+    assert(freed == 1);
+
+    thread_init(&thr, second, NULL);
+    thread_fini(&thr);
+    assert(resets == 2);
+
+    /* The reset hooks only run after functions that return. */
+    thread_init(&thr, exiting, NULL);
+    thread_fini(&thr);
+    assert(resets == 2);
+
+    thread_init(&thr, after_exit, NULL);
+    thread_fini(&thr);
+    assert(resets == 3);
+    return 0;
+}
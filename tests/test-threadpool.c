@@ -1,4 +1,5 @@
 #include <pthread.h>
+#include <unistd.h>
 
 #include "logger.h"
 #include "threadpool.h"
@@ -38,6 +39,12 @@ int main()
         check_exit(rc == 0, "threadpool_add error");
     }
 
+    threadpool_stats_t stats;
+    do {
+        check_exit(threadpool_stats(tp, &stats) == 0, "threadpool_stats error");
+        check_exit(stats.added == 15, "threadpool_stats added error");
+    } while (stats.completed < 15 && !usleep(1000));
+
     check_exit(threadpool_destroy(tp, 1) == 0, "threadpool_destroy error");
 
     check_exit(sum == 120, "sum error");
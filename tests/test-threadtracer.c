@@ -0,0 +1,319 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "threadtracer.h"
+
+static void test_nested_scopes(void)
+{
+    /* Scopes with the same tag nest, and each "E" closes the innermost. */
+    assert(TT_BEGIN("outer") >= 0);
+    assert(TT_BEGIN("outer") >= 0);
+    assert(TT_BEGIN("inner") >= 0);
+    assert(TT_END("inner") >= 0);
+    assert(TT_END("outer") >= 0);
+    assert(TT_END("outer") >= 0);
+}
+
+static int scope_guard(int early)
+{
+    TT_SCOPE("guarded");
+    if (early)
+        return 1;
+    {
+        TT_SCOPE("guarded");
+        TT_SCOPE("inner");
+    }
+    return 0;
+}
+
+static void test_scope_guards(void)
+{
+    /* The "E" events are recorded on every way out of the scope. */
+    assert(scope_guard(1) == 1);
+    assert(scope_guard(0) == 0);
+}
+
+static void test_unbalanced_scopes(void)
+{
+    /* An "E" without an open "B" is discarded at report time. */
+    assert(TT_END("stray") >= 0);
+
+    /* Closing an outer scope also closes scopes left open inside it. */
+    assert(TT_BEGIN("parent") >= 0);
+    assert(TT_BEGIN("unclosed") >= 0);
+    assert(TT_END("parent") >= 0);
+    assert(TT_END("unclosed") >= 0);
+}
+
+static void test_escaped_tags(void)
+{
+    /* Tags are arbitrary strings, and must not corrupt the JSON output. */
+    assert(TT_BEGIN("\"quoted\" \\ and\nnewline\t") >= 0);
+    assert(TT_END("\"quoted\" \\ and\nnewline\t") >= 0);
+}
+
+static int async_object;
+
+static void *async_end_thread(void *arg UNUSED)
+{
+    assert(TT_ENTRY("async") >= 0);
+    assert(TT_BEGIN("execute") >= 0);
+    assert(TT_FLOW_END(&async_object, "handoff") >= 0);
+    assert(TT_END("execute") >= 0);
+    assert(TT_ASYNC_END(&async_object, "handoff") >= 0);
+    return NULL;
+}
+
+static void test_async_spans(void)
+{
+    /* An asynchronous span and a flow that begin on this thread, and end on
+     * another one.
+     */
+    pthread_t thread;
+
+    assert(TT_BEGIN("submit") >= 0);
+    assert(TT_ASYNC_BEGIN(&async_object, "handoff") >= 0);
+    assert(TT_FLOW_BEGIN(&async_object, "handoff") >= 0);
+    assert(TT_END("submit") >= 0);
+
+    assert(!pthread_create(&thread, NULL, async_end_thread, NULL));
+    assert(!pthread_join(thread, NULL));
+}
+
+static void test_counters_and_instants(void)
+{
+    for (int i = 0; i < 3; i++)
+        assert(TT_COUNTER("depth", i) >= 0);
+    assert(TT_COUNTER("depth", -1) >= 0);
+    assert(TT_INSTANT("marker") >= 0);
+}
+
+static void test_not_signed_in(void)
+{
+    /* Threads that did not sign in are not traced. */
+    assert(TT_BEGIN("unsigned") < 0);
+    assert(TT_END("unsigned") < 0);
+}
+
+static void *not_signed_in_thread(void *arg UNUSED)
+{
+    test_not_signed_in();
+    return NULL;
+}
+
+/* A protobuf field read by pb_next: a varint, or the bytes of a string or
+ * message.
+ */
+struct pb_field {
+    int field;
+    int wire;
+    uint64_t value;
+    const unsigned char *bytes;
+};
+
+static uint64_t pb_varint(const unsigned char **p, const unsigned char *end)
+{
+    uint64_t v = 0;
+    for (int shift = 0; *p < end; shift += 7) {
+        const unsigned char c = *(*p)++;
+        v |= (uint64_t) (c & 0x7f) << shift;
+        if (!(c & 0x80))
+            return v;
+    }
+    assert(!"truncated varint");
+    return 0;
+}
+
+/* Read the next field of the message from *p to end. */
+static int pb_next(const unsigned char **p,
+                   const unsigned char *end,
+                   struct pb_field *f)
+{
+    if (*p == end)
+        return 0;
+    const uint64_t key = pb_varint(p, end);
+    f->field = key >> 3;
+    f->wire = key & 7;
+    f->bytes = NULL;
+    switch (f->wire) {
+    case 0:
+        f->value = pb_varint(p, end);
+        break;
+    case 1:
+        assert(end - *p >= 8);
+        f->value = 0;
+        *p += 8;
+        break;
+    case 2:
+        f->value = pb_varint(p, end);
+        assert(f->value <= (uint64_t) (end - *p));
+        f->bytes = *p;
+        *p += f->value;
+        break;
+    default:
+        assert(!"unexpected wire type");
+    }
+    return 1;
+}
+
+/* Check that the Perfetto trace in 'name' starts with the process track and
+ * the thread track of this thread, that its first event is the "outer" slice
+ * of test_nested_scopes, and that every slice that begins on a track also
+ * ends on it.
+ */
+static void check_perfetto(const char *name)
+{
+    static unsigned char buf[64 * 1024];
+    struct {
+        uint64_t uuid;
+        int depth;
+    } tracks[16];
+    int numtracks = 0;
+    int packets = 0;
+
+    FILE *f = fopen(name, "rb");
+    assert(f);
+    const size_t n = fread(buf, 1, sizeof(buf), f);
+    assert(n < sizeof(buf));
+    fclose(f);
+
+    const unsigned char *p = buf, *end = buf + n;
+    struct pb_field packet;
+    while (pb_next(&p, end, &packet)) {
+        /* Trace.packet */
+        assert(packet.field == 1 && packet.wire == 2);
+        const unsigned char *q = packet.bytes, *qend = q + packet.value;
+        struct pb_field field, sub, sub2;
+        int type = 0;
+        uint64_t track = 0;
+        const unsigned char *eventname = NULL;
+        uint64_t namelen = 0;
+
+        while (pb_next(&q, qend, &field)) {
+            const unsigned char *r = field.bytes;
+            const unsigned char *rend = r ? r + field.value : NULL;
+            if (field.field == 60) {
+                /* TracePacket.track_descriptor */
+                assert(field.wire == 2);
+                while (pb_next(&r, rend, &sub)) {
+                    if (packets == 0 && sub.field == 3) {
+                        /* ProcessDescriptor.pid */
+                        const unsigned char *s = sub.bytes;
+                        assert(pb_next(&s, s + sub.value, &sub2));
+                        assert(sub2.field == 1 && (pid_t) sub2.value == getpid());
+                    }
+                    if (packets == 1 && sub.field == 4) {
+                        /* ThreadDescriptor: pid, tid, then thread_name */
+                        const unsigned char *s = sub.bytes;
+                        const unsigned char *send = s + sub.value;
+                        assert(pb_next(&s, send, &sub2) && sub2.field == 1);
+                        assert(pb_next(&s, send, &sub2) && sub2.field == 2);
+                        assert(pb_next(&s, send, &sub2) && sub2.field == 5);
+                        assert(sub2.value == 4);
+                        assert(!memcmp(sub2.bytes, "main", 4));
+                    }
+                }
+            } else if (field.field == 11) {
+                /* TracePacket.track_event */
+                assert(field.wire == 2);
+                while (pb_next(&r, rend, &sub)) {
+                    if (sub.field == 9)
+                        type = sub.value;
+                    else if (sub.field == 11)
+                        track = sub.value;
+                    else if (sub.field == 23) {
+                        eventname = sub.bytes;
+                        namelen = sub.value;
+                    }
+                }
+            }
+        }
+
+        if (packets++ == 2) {
+            /* TYPE_SLICE_BEGIN of "outer" */
+            assert(type == 1);
+            assert(namelen == 5 && !memcmp(eventname, "outer", 5));
+        }
+        if (type != 1 && type != 2)
+            continue;
+
+        int t = 0;
+        while (t < numtracks && tracks[t].uuid != track)
+            t++;
+        if (t == numtracks) {
+            assert(numtracks < 16);
+            tracks[numtracks].uuid = track;
+            tracks[numtracks++].depth = 0;
+        }
+        /* A SLICE_END has no name, as it ends the innermost slice. */
+        assert(type == 1 || !eventname);
+        tracks[t].depth += type == 1 ? 1 : -1;
+        assert(tracks[t].depth >= 0);
+    }
+    assert(p == end);
+    for (int t = 0; t < numtracks; ++t)
+        assert(tracks[t].depth == 0);
+}
+
+/* Check that the JSON report in 'name' is framed as a whole trace, and that
+ * the tag of test_escaped_tags is escaped in it.
+ */
+static void check_json(const char *name)
+{
+    FILE *f = fopen(name, "r");
+    assert(f);
+    assert(!fseek(f, 0, SEEK_END));
+    const long size = ftell(f);
+    assert(size > 0);
+    rewind(f);
+    char *buf = malloc(size + 1);
+    assert(buf);
+    assert(fread(buf, 1, size, f) == (size_t) size);
+    buf[size] = '\0';
+    fclose(f);
+
+    const char *start = "{\"traceEvents\":[\n";
+    assert(!strncmp(buf, start, strlen(start)));
+    assert(strstr(buf, "\n],\"otherData\":{"));
+    assert(size >= 3 && !strcmp(buf + size - 3, "}}\n"));
+    assert(strstr(buf, "\"name\":\"\\\"quoted\\\" \\\\ and"
+                       "\\u000anewline\\u0009\""));
+    free(buf);
+}
+
+int main(void)
+{
+    pthread_t thread;
+
+    test_not_signed_in();
+    assert(TT_ENTRY("main") == 0);
+    /* Signing in again keeps the slot. */
+    assert(TT_ENTRY("main") == 0);
+
+    test_nested_scopes();
+    test_scope_guards();
+    test_unbalanced_scopes();
+    test_escaped_tags();
+    test_async_spans();
+    test_counters_and_instants();
+
+    assert(!pthread_create(&thread, NULL, not_signed_in_thread, NULL));
+    assert(!pthread_join(thread, NULL));
+
+    /* 6 nested events, 8 from scope guards, 3 of the 5 unbalanced ones, 2
+     * escaped ones, 8 for the async span, 4 counter values and an instant.
+     * A snapshot in the Perfetto format holds the same events.
+     */
+    assert(tt_snapshot("threadtracer.test.pftrace") == 32);
+    check_perfetto("threadtracer.test.pftrace");
+    unlink("threadtracer.test.pftrace");
+    assert(tt_report("threadtracer.test.json") == 32);
+    check_json("threadtracer.test.json");
+    unlink("threadtracer.test.json");
+    return 0;
+}
@@ -0,0 +1,76 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+
+#include "thread.h"
+
+static void value_dtor(void *value);
+
+TLS_VAR_DECLARE_STATIC(tls_plain);
+TLS_VAR_DECLARE_STATIC_DTOR(tls_dtor, value_dtor);
+
+static int values[3];
+static atomic_int dtor_calls;
+static void *_Atomic dtor_value;
+
+static void value_dtor(void *value)
+{
+    assert(value);
+    dtor_value = value;
+    dtor_calls++;
+}
+
+/* A new thread starts with NULL in both variables, and what it sets is its
+ * own.
+ */
+static void *set_values(void *v_value)
+{
+    assert(!TLS_VAR_GET(tls_plain));
+    assert(!TLS_VAR_GET(tls_dtor));
+    assert(!TLS_VAR_SET(tls_plain, v_value));
+    assert(!TLS_VAR_SET(tls_dtor, v_value));
+    assert(TLS_VAR_GET(tls_plain) == v_value);
+    assert(TLS_VAR_GET(tls_dtor) == v_value);
+    return NULL;
+}
+
+static void *set_and_clear(void *v_value)
+{
+    assert(!TLS_VAR_SET(tls_dtor, v_value));
+    assert(!TLS_VAR_SET(tls_dtor, NULL));
+    return NULL;
+}
+
+static void *set_nothing(void *unused)
+{
+    (void) unused;
+    return NULL;
+}
+
+static void run(void *(*func)(void *), void *arg)
+{
+    pthread_t thread;
+
+    assert(!pthread_create(&thread, NULL, func, arg));
+    assert(!pthread_join(thread, NULL));
+}
+
+int main(void)
+{
+    assert(!TLS_VAR_SET(tls_plain, &values[0]));
+    assert(!TLS_VAR_SET(tls_dtor, &values[0]));
+
+    /* The destructor is called with the value of the thread that exits. */
+    run(set_values, &values[1]);
+    assert(dtor_calls == 1);
+    assert(dtor_value == &values[1]);
+    assert(TLS_VAR_GET(tls_plain) == &values[0]);
+    assert(TLS_VAR_GET(tls_dtor) == &values[0]);
+
+    /* But not for threads whose value is NULL when they exit. */
+    run(set_and_clear, &values[2]);
+    run(set_nothing, NULL);
+    assert(dtor_calls == 1);
+    return 0;
+}
@@ -0,0 +1,60 @@
+/* Built with -DTHREADTRACER_DISABLE -Werror: every TT_ macro must compile to
+ * nothing, without evaluating its arguments or leaving variables that are only
+ * traced unused.
+ */
+#include <assert.h>
+
+#include "threadtracer.h"
+
+static int calls;
+
+static const char *tag(void)
+{
+    calls++;
+    return "tag";
+}
+
+static int scoped(int depth)
+{
+    /* A variable only used by the tracing. */
+    const int traced = depth * 2;
+    TT_SCOPE("scoped");
+    TT_SCOPE_CAT("cat", "scoped");
+    int result = depth + 1;
+    TT_COUNTER("traced", traced);
+    return result;
+}
+
+int main(void)
+{
+    int i = 0;
+    int object;
+
+    assert(TT_ENTRY(tag()) == 0);
+    assert(TT_BEGIN(tag()) == 0);
+    assert(TT_END(tag()) == 0);
+    assert(TT_BEGIN_CAT("cat", tag()) == 0);
+    assert(TT_END_CAT("cat", tag()) == 0);
+    assert(TT_ASYNC_BEGIN(&object, tag()) == 0);
+    assert(TT_ASYNC_END(&object, tag()) == 0);
+    assert(TT_ASYNC_BEGIN_CAT("cat", &object, tag()) == 0);
+    assert(TT_ASYNC_END_CAT("cat", &object, tag()) == 0);
+    assert(TT_FLOW_BEGIN(&object, tag()) == 0);
+    assert(TT_FLOW_END(&object, tag()) == 0);
+    assert(TT_FLOW_BEGIN_CAT("cat", &object, tag()) == 0);
+    assert(TT_FLOW_END_CAT("cat", &object, tag()) == 0);
+    assert(TT_COUNTER("x", i++) == 0);
+    assert(TT_COUNTER_CAT("cat", "x", i++) == 0);
+    assert(TT_INSTANT(tag()) == 0);
+    assert(TT_INSTANT_CAT("cat", tag()) == 0);
+    assert(TT_WAIT_BEGIN(i++ ? TT_WAIT_IO : TT_WAIT_MUTEX) == 0);
+    assert(TT_WAIT_END() == 0);
+    assert(scoped(1) == 2);
+    assert(TT_SNAPSHOT() == 0);
+    assert(TT_REPORT() == 0);
+
+    /* No argument was evaluated. */
+    assert(i == 0);
+    assert(calls == 0);
+    return 0;
+}
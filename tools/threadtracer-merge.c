@@ -0,0 +1,207 @@
+/* Merge the reports of several processes into one trace, on one timeline.
+ *
+ * Usage: threadtracer-merge <output> <input>...
+ *
+ * JSON reports record the CLOCK_MONOTONIC time that their timestamps are
+ * relative to, so their timestamps are rebased onto the earliest of those.
+ * Processes that happen to share a pid, e.g. on different runs, are given
+ * unused pids.  Perfetto traces (.pftrace) always have absolute timestamps
+ * and unique ids, so they are simply concatenated, which protobuf defines as
+ * merging their packets.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAXINPUTS 1024
+
+struct input {
+    const char *name;
+    char *data;          /* the whole file, NUL terminated */
+    size_t len;
+    long long offset;    /* clock_offset_ns */
+    long long pid;       /* the pid it recorded */
+    long long newpid;    /* the pid it gets in the merged trace */
+};
+
+static struct input inputs[MAXINPUTS];
+
+static int load(struct input *in)
+{
+    FILE *f = fopen(in->name, "rb");
+    if (!f) {
+        perror(in->name);
+        return -1;
+    }
+    size_t cap = 1 << 16;
+    in->data = malloc(cap);
+    in->len = 0;
+    while (in->data) {
+        in->len += fread(in->data + in->len, 1, cap - in->len - 1, f);
+        if (in->len < cap - 1)
+            break;
+        cap *= 2;
+        char *data = realloc(in->data, cap);
+        if (!data)
+            free(in->data);
+        in->data = data;
+    }
+    int failed = ferror(f) || !in->data;
+    fclose(f);
+    if (failed) {
+        fprintf(stderr, "%s: cannot read the file\n", in->name);
+        return -1;
+    }
+    in->data[in->len] = '\0';
+    return 0;
+}
+
+static int is_json(const struct input *in)
+{
+    return in->len && in->data[0] == '{';
+}
+
+/* The number after the first occurrence of 'key' in 's', or 'dflt'. */
+static long long find_number(const char *s, const char *key, long long dflt)
+{
+    const char *p = strstr(s, key);
+    return p ? strtoll(p + strlen(key), NULL, 10) : dflt;
+}
+
+/* Find the next 'key' in 's' that is not inside a string.  ThreadTracer
+ * escapes quotes in strings, so a key can only start with an unescaped quote.
+ */
+static char *find_key(char *s, const char *key)
+{
+    for (char *p = strstr(s, key); p; p = strstr(p + 1, key))
+        if (p == s || p[-1] != '\\')
+            return p;
+    return NULL;
+}
+
+/* Write an event line, rebasing "ts" by 'delta' microseconds and replacing
+ * the pid.
+ */
+static void write_event(FILE *out, char *line, long long delta,
+                        long long pid)
+{
+    char *p = line;
+    for (;;) {
+        char *ts = find_key(p, "\"ts\":");
+        char *pi = find_key(p, "\"pid\":");
+        char *next = !ts ? pi : !pi ? ts : ts < pi ? ts : pi;
+        if (!next)
+            break;
+        const int ists = next == ts;
+        const size_t keylen = ists ? 5 : 6;
+        fwrite(p, 1, next + keylen - p, out);
+        char *end;
+        long long v = strtoll(next + keylen, &end, 10);
+        fprintf(out, "%lld", ists ? v + delta : pid);
+        p = end;
+    }
+    fputs(p, out);
+}
+
+static int merge_json(FILE *out, int n)
+{
+    long long base = inputs[0].offset;
+    for (int i = 1; i < n; ++i)
+        if (inputs[i].offset < base)
+            base = inputs[i].offset;
+
+    int first = 1, events = 0;
+    fprintf(out, "{\"traceEvents\":[\n");
+    for (int i = 0; i < n; ++i) {
+        const long long delta = (inputs[i].offset - base) / 1000;
+        /* Events are one per line, between the first line and "]". */
+        char *line = strchr(inputs[i].data, '\n');
+        while (line && *++line && *line != ']') {
+            char *eol = strchr(line, '\n');
+            if (eol)
+                *eol = '\0';
+            size_t len = strlen(line);
+            if (len && line[len - 1] == ',')
+                line[len - 1] = '\0';
+            if (*line) {
+                fputs(first ? "" : ",\n", out);
+                write_event(out, line, delta, inputs[i].newpid);
+                first = 0;
+                /* Not counting the thread names. */
+                events += !strstr(line, "\"ph\": \"M\"");
+            }
+            line = eol;
+        }
+    }
+    fprintf(out,
+            "\n],\"otherData\":{\"clock\":\"CLOCK_MONOTONIC\","
+            "\"clock_offset_ns\":%lld}}\n",
+            base);
+    return events;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 3 || argc - 2 > MAXINPUTS) {
+        fprintf(stderr, "Usage: %s <output> <input>...\n", argv[0]);
+        return 2;
+    }
+
+    const int n = argc - 2;
+    int json = 0;
+    for (int i = 0; i < n; ++i) {
+        struct input *in = inputs + i;
+        in->name = argv[i + 2];
+        if (load(in) < 0)
+            return 1;
+        if (i && is_json(in) != json) {
+            fprintf(stderr, "%s: cannot merge JSON and Perfetto traces\n",
+                    in->name);
+            return 1;
+        }
+        json = is_json(in);
+        if (!json)
+            continue;
+        if (!strstr(in->data, "\"clock_offset_ns\":"))
+            fprintf(stderr, "%s: no clock offset, assuming 0\n", in->name);
+        in->offset = find_number(in->data, "\"clock_offset_ns\":", 0);
+        in->pid = in->newpid = find_number(in->data, "\"pid\":", 0);
+        for (int j = 0; j < i; ++j) {
+            if (inputs[j].newpid != in->newpid)
+                continue;
+            /* Give it a pid that is not used yet. */
+            long long pid = in->pid;
+            for (int k = 0; k < i; ++k)
+                if (inputs[k].newpid >= pid)
+                    pid = inputs[k].newpid + 1;
+            in->newpid = pid;
+            fprintf(stderr, "%s: pid %lld is taken, using %lld\n", in->name,
+                    in->pid, in->newpid);
+            break;
+        }
+    }
+
+    FILE *out = fopen(argv[1], "wb");
+    if (!out) {
+        perror(argv[1]);
+        return 1;
+    }
+    int events = 0;
+    if (json)
+        events = merge_json(out, n);
+    else
+        for (int i = 0; i < n; ++i)
+            fwrite(inputs[i].data, 1, inputs[i].len, out);
+    if (fclose(out)) {
+        perror(argv[1]);
+        return 1;
+    }
+    if (json)
+        fprintf(stderr, "Merged %d events from %d files to %s\n", events, n,
+                argv[1]);
+    else
+        fprintf(stderr, "Merged %d files to %s\n", n, argv[1]);
+    return 0;
+}
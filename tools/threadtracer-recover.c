@@ -0,0 +1,276 @@
+/* Convert the trace files that ThreadTracer records with THREADTRACERMMAP set
+ * into a Chrome tracing JSON file, when the process that recorded them did not
+ * get to write its report, for instance because it crashed.
+ *
+ * Usage: threadtracer-recover <output.json> <threadtracer.*.trace>...
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "threadtracer_file.h"
+
+/* The string table of a file, sorted by key. */
+struct strings {
+    const tracestring_t **entries;
+    size_t n;
+};
+
+static int compare_keys(const void *a, const void *b)
+{
+    const tracestring_t *sa = *(const tracestring_t *const *) a;
+    const tracestring_t *sb = *(const tracestring_t *const *) b;
+    return sa->key < sb->key ? -1 : sa->key > sb->key;
+}
+
+static int strings_load(struct strings *strs, const tracefile_t *f)
+{
+    const char *table = TRACEFILE_STRINGS(f, f->maxsamples);
+    size_t used = atomic_load(&f->stringbytes);
+    if (used > TRACEFILE_STRINGBYTES)
+        used = TRACEFILE_STRINGBYTES;
+
+    strs->n = 0;
+    strs->entries = malloc((used / sizeof(tracestring_t) + 1) *
+                           sizeof(*strs->entries));
+    if (!strs->entries)
+        return -1;
+    for (size_t off = 0; off + sizeof(tracestring_t) <= used;) {
+        const tracestring_t *str = (const tracestring_t *) (table + off);
+        size_t n = (sizeof(tracestring_t) + str->len + 1 + 7) & ~(size_t) 7;
+        if (off + n > used || str->str[str->len])
+            break;
+        strs->entries[strs->n++] = str;
+        off += n;
+    }
+    qsort(strs->entries, strs->n, sizeof(*strs->entries), compare_keys);
+    return 0;
+}
+
+/* The string that 'p' pointed to in the traced process. */
+static const char *strings_find(const struct strings *strs, const char *p)
+{
+    tracestring_t key = {.key = (uintptr_t) p};
+    const tracestring_t *k = &key;
+    const tracestring_t **found = bsearch(&k, strs->entries, strs->n,
+                                          sizeof(*strs->entries), compare_keys);
+    return found ? (*found)->str : "?";
+}
+
+static void write_escaped(FILE *out, const char *s)
+{
+    for (const unsigned char *c = (const unsigned char *) s; *c; ++c) {
+        if (*c == '"' || *c == '\\')
+            fprintf(out, "\\%c", *c);
+        else if (*c < 0x20)
+            fprintf(out, "\\u%04x", *c);
+        else
+            fputc(*c, out);
+    }
+}
+
+/* Write the time a scope spent waiting per reason, and for something else,
+ * as the live report does.
+ */
+static void write_waits(FILE *out,
+                        const int64_t *end,
+                        const int64_t *begin,
+                        int64_t offcpu)
+{
+    static const char *const names[] = {TRACEFILE_WAITNAMES};
+    for (int i = 0; i < TRACEFILE_WAITREASONS; ++i) {
+        fprintf(out, ",\"%s\":%lld", names[i],
+                (long long) ((end[i] - begin[i]) / 1000));
+        offcpu -= end[i] - begin[i];
+    }
+    fprintf(out, ",\"wait_other(us)\":%lld",
+            (long long) (offcpu > 0 ? offcpu / 1000 : 0));
+}
+
+/* Write the hardware counters of a scope, as the live report does, unless
+ * they could not be read.
+ */
+static void write_perf(FILE *out, const int64_t *end, const int64_t *begin)
+{
+    static const char *const names[] = {TRACEFILE_PERFNAMES};
+    for (int i = 0; i < TRACEFILE_NUMPERF; ++i)
+        if (end[i] < 0 || begin[i] < 0)
+            return;
+    for (int i = 0; i < TRACEFILE_NUMPERF; ++i)
+        fprintf(out, ",\"%s\":%lld", names[i],
+                (long long) (end[i] - begin[i]));
+    const int64_t cycles = end[0] - begin[0];
+    fprintf(out, ",\"ipc(%%)\":%lld",
+            (long long) (cycles ? 100 * (end[1] - begin[1]) / cycles : 0));
+}
+
+/* Write the events of one file.  Returns the number written, or -1. */
+static int recover(FILE *out,
+                   const char *name,
+                   int *entries,
+                   int64_t *walloffset)
+{
+    int fd = open(name, O_RDONLY);
+    if (fd < 0) {
+        perror(name);
+        return -1;
+    }
+    struct stat st;
+    void *p = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (size_t) st.st_size >= sizeof(tracefile_t))
+        p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+        fprintf(stderr, "%s: cannot map the file\n", name);
+        return -1;
+    }
+
+    const tracefile_t *f = p;
+    if (memcmp(f->magic, TRACEFILE_MAGIC, sizeof(f->magic)) ||
+        f->samplesize != sizeof(sample_t) ||
+        (size_t) st.st_size < TRACEFILE_SIZE(f->maxsamples)) {
+        fprintf(stderr, "%s: not a ThreadTracer trace file of this version\n",
+                name);
+        munmap(p, st.st_size);
+        return -1;
+    }
+
+    *walloffset = f->walloffset;
+    struct strings strs;
+    if (strings_load(&strs, f) < 0) {
+        munmap(p, st.st_size);
+        return -1;
+    }
+
+    const sample_t *samples = TRACEFILE_SAMPLES(f);
+    const int64_t(*waits)[TRACEFILE_WAITREASONS] =
+        TRACEFILE_WAITS(f, f->maxsamples);
+    const int64_t(*perf)[TRACEFILE_NUMPERF] = TRACEFILE_PERF(f, f->maxsamples);
+    int cnt = atomic_load(&f->samplecount);
+    if (cnt < 0 || (uint32_t) cnt > f->maxsamples)
+        cnt = f->maxsamples;
+    int written = 0;
+    for (int s = 0; s < cnt; ++s) {
+        const sample_t *sample = samples + s;
+        const sample_t *beginsample = NULL;
+        if (!sample->phase)
+            continue;
+        const char *phase = strings_find(&strs, sample->phase);
+        if (phase[0] == 'E') {
+            if (sample->begin < 0 || sample->begin >= s)
+                continue;
+            beginsample = samples + sample->begin;
+        }
+
+        fprintf(out, "%s{\"cat\":\"", *entries ? ",\n" : "");
+        write_escaped(out, strings_find(&strs, sample->cat));
+        fprintf(out, "\",\"pid\":%lld,\"tid\":%llu,\"ts\":%lld,\"tts\":%lld",
+                (long long) f->pid, (unsigned long long) f->threadid,
+                (long long) (sample->wall_time / 1000),
+                (long long) (sample->cpu_time / 1000));
+        fprintf(out, ",\"ph\":\"");
+        write_escaped(out, phase);
+        fprintf(out, "\",\"name\":\"");
+        write_escaped(out, strings_find(&strs, sample->tag));
+        fprintf(out, "\"");
+        switch (phase[0]) {
+        case 'f':
+            fprintf(out, ",\"bp\":\"e\"");
+            /* fall through */
+        case 'b':
+        case 'e':
+        case 's':
+            fprintf(out, ",\"id\":\"0x%llx\"", (unsigned long long) sample->id);
+            break;
+        case 'i':
+            fprintf(out, ",\"s\":\"t\"");
+            break;
+        }
+        fprintf(out, ",\"args\":{");
+        if (beginsample) {
+            long long walldur = sample->wall_time - beginsample->wall_time;
+            long long cpudur = sample->cpu_time - beginsample->cpu_time;
+            fprintf(out, "\"preempted\":%lld,\"voluntary\":%lld",
+                    (long long) (sample->num_preemptive_switch -
+                                 beginsample->num_preemptive_switch),
+                    (long long) (sample->num_voluntary_switch -
+                                 beginsample->num_voluntary_switch));
+            const long long dutycycle = walldur ? 100 * cpudur / walldur : 100;
+            fprintf(out, ",\"dutycycle(%%)\":%lld", dutycycle);
+            if (f->offcputhreshold && dutycycle < f->offcputhreshold)
+                write_waits(out, waits[s], waits[sample->begin],
+                            walldur - cpudur);
+            if (f->perfcounting)
+                write_perf(out, perf[s], perf[sample->begin]);
+        } else if (phase[0] == 'C') {
+            fprintf(out, "\"value\":%lld", (long long) sample->value);
+        }
+        fprintf(out, "}}");
+        (*entries)++;
+        written++;
+    }
+
+    fprintf(out, "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\":%lld, "
+                 "\"tid\":%llu, \"args\": { \"name\" : \"",
+            *entries ? ",\n" : "", (long long) f->pid,
+            (unsigned long long) f->threadid);
+    char threadname[sizeof(f->threadname) + 1] = {0};
+    memcpy(threadname, f->threadname, sizeof(f->threadname));
+    write_escaped(out, threadname);
+    fprintf(out, "\" } }");
+    (*entries)++;
+
+    free(strs.entries);
+    munmap(p, st.st_size);
+    return written;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s <output.json> <threadtracer.*.trace>...\n",
+                argv[0]);
+        return 2;
+    }
+
+    FILE *out = fopen(argv[1], "w");
+    if (!out) {
+        perror(argv[1]);
+        return 1;
+    }
+
+    int failed = 0, entries = 0, events = 0, files = 0;
+    int64_t walloffset = 0, fileoffset;
+    fprintf(out, "{\"traceEvents\":[\n");
+    for (int i = 2; i < argc; ++i) {
+        int n = recover(out, argv[i], &entries, &fileoffset);
+        if (n < 0) {
+            failed = 1;
+            continue;
+        }
+        /* The files of a process share their offset. */
+        if (files++ && fileoffset != walloffset)
+            fprintf(stderr,
+                    "%s: from another process, recover it separately and "
+                    "use threadtracer-merge\n",
+                    argv[i]);
+        walloffset = fileoffset;
+        events += n;
+    }
+    fprintf(out,
+            "\n],\"otherData\":{\"clock\":\"CLOCK_MONOTONIC\","
+            "\"clock_offset_ns\":%lld}}\n",
+            (long long) walloffset);
+    if (fclose(out)) {
+        perror(argv[1]);
+        return 1;
+    }
+    fprintf(stderr, "Recovered %d events from %d files to %s\n", events,
+            argc - 2, argv[1]);
+    return failed;
+}